@@ -1,5 +1,24 @@
 #include "SimpleMemoryManager.h"
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <string.h>
+#include <unistd.h>
+
+// Write to every page of the buffer, keeping its contents, so the page faults
+// happen now and not under traffic
+static void touchBuffer(void *buffer, size_t size) {
+	static const size_t pageSize = sysconf(_SC_PAGESIZE);
+	volatile char *bytes = (volatile char *)buffer;
+
+	if ( buffer == NULL || size == 0 )
+		return;
+
+	for (size_t offset = 0; offset < size; offset += pageSize)
+		bytes[offset] = bytes[offset];
+	bytes[size - 1] = bytes[size - 1];
+}
 
 SimpleMemoryManager::SimpleMemoryManager(const size_t size, unsigned int poolSize) {
 	int index, err_index;
@@ -26,19 +45,29 @@ SimpleMemoryManager::SimpleMemoryManager(const size_t size, unsigned int poolSiz
 				pool_size = -1;
 				// Need to send error up
 			}
+			touchBuffer(freeQueue[index], size);
 		}
 	}
 
+	// Without storage the free queue starts empty and is filled by
+	// loadMemoryManager. With storage it starts full.
 	buffSize = size;
-	freeHead = pool_size - 1;
+	freeHead = 0;
 	fullHead = 0;
 	fullTail = 0;
 	freeTail = 0;
-	freeCount = pool_size;
+	freeCount = ( size == 0 ) ? 0 : pool_size;
 	fullCount = 0;
+	stops_ = 0;
 
-	freeSema_ = new Semaphore(pool_size - 1);
+	freeSema_ = new Semaphore(freeCount);
 	fullSema_ = new Semaphore(0);
+
+	mode_ = MODE_FIFO;
+	lanes_ = 1;
+	laneQueue_ = NULL;
+	laneHead_ = laneTail_ = laneCount_ = NULL;
+	seq_ = 0;
 }
 
 SimpleMemoryManager::~SimpleMemoryManager() {
@@ -59,6 +88,10 @@ SimpleMemoryManager::~SimpleMemoryManager() {
 		free(freeQueue);
 	}
 
+	free(laneQueue_);
+	free(laneHead_);
+	free(laneTail_);
+	free(laneCount_);
 }
 
 
@@ -79,8 +112,16 @@ void *SimpleMemoryManager::getFreeBuffer() {
 void *SimpleMemoryManager::getFullBuffer() {
 	void *buffer = NULL;
 
+	if ( mode_ != MODE_FIFO )
+		return getFullBuffer((bufferTag *)NULL);
 
 	fullMutex_.lock();
+	if ( fullCount == stops_ ) {
+		--fullCount;
+		--stops_;
+		fullMutex_.unlock();
+		return NULL;
+	}
 	--fullCount;
 	buffer = fullQueue[fullTail];
 	fullQueue[fullTail] = NULL;
@@ -100,22 +141,32 @@ int SimpleMemoryManager::putFreeBuffer(void *buffer) {
 	++freeCount;
 	freeQueue[freeHead] = buffer;
 	freeHead = (freeHead + 1) % pool_size;
+	bool done = freeCount == pool_size;
 
 	freeMutex_.unlock();
 
 	freeSema_->notify();
+	if ( done )
+		doneCv_.notify_all();
 
 	return pool_size - freeCount;
 }
 
 int SimpleMemoryManager::putFullBuffer(void *buffer) {
 
+	if ( mode_ != MODE_FIFO && buffer != NULL )
+		return putFullBuffer(buffer, getDefaultTag());
 
 	fullMutex_.lock();
 
+	// A NULL is only counted, the queue has room for the pool and no more
 	++fullCount;
-	fullQueue[fullHead] = buffer;
-	fullHead = (fullHead + 1) % pool_size;
+	if ( buffer == NULL )
+		++stops_;
+	else {
+		fullQueue[fullHead] = buffer;
+		fullHead = (fullHead + 1) % pool_size;
+	}
 
 	fullMutex_.unlock();
 
@@ -154,14 +205,19 @@ void SimpleMemoryManager::waitForFree() {
 	freeSema_->wait();
 }
 
+bool SimpleMemoryManager::tryWaitForFree() {
+
+	return freeSema_->tryWait();
+}
+
 // Wait for the free queue to be the same as the buffer count, in which case
 // there is no buffers are being processed
 void SimpleMemoryManager::waitForDone()
 {
-	while ( getFreeCount() != getBufferCount() ) {
-//		std::cout << "getFreeCount() = " << getFreeCount() << " getBufferCount() = " << getBufferCount() << std::endl;
-		waitForFree();
-	}
+	std::unique_lock<std::mutex> lock(freeMutex_);
+
+	while ( freeCount != pool_size )
+		doneCv_.wait(lock);
 }
 
 // Block until full queue is empty
@@ -174,9 +230,242 @@ void SimpleMemoryManager::waitForEmpty() {
 // Load the memory manager with user provided buffers
 
 void SimpleMemoryManager::loadMemoryManager(void *buffer) {
-	waitForFree();
-	getFreeBuffer();
-	putFullBuffer(buffer);
-	waitForFull();
-	putFreeBuffer(getFullBuffer());
+	putFreeBuffer(buffer);
+}
+
+int SimpleMemoryManager::loadMemoryManager(void **buffers, int count, size_t touchSize) {
+	int index;
+
+	freeMutex_.lock();
+	if ( count > pool_size - freeCount ) {
+		std::cout << "SimpleMemoryManager::loadMemoryManager() - ERROR " << count << " buffers do not fit, loading " << pool_size - freeCount << std::endl;
+		count = pool_size - freeCount;
+	}
+	freeMutex_.unlock();
+
+	for ( index = 0; index < count; ++index)
+		touchBuffer(buffers[index], touchSize);
+
+	freeMutex_.lock();
+	for ( index = 0; index < count; ++index) {
+		freeQueue[freeHead] = buffers[index];
+		freeHead = (freeHead + 1) % pool_size;
+	}
+	freeCount += count;
+	bool done = freeCount == pool_size;
+	freeMutex_.unlock();
+
+	freeSema_->notify(count);
+	if ( done )
+		doneCv_.notify_all();
+
+	return count;
+}
+
+// Lanes and deadlines
+
+long long SimpleMemoryManager::now() {
+
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Heap order for deadline mode: earliest deadline on top, FIFO among equals
+bool SimpleMemoryManager::laterDeadline(const laneEntry &a, const laneEntry &b) {
+
+	if ( a.tag.deadline != b.tag.deadline )
+		return a.tag.deadline > b.tag.deadline;
+	return a.seq > b.seq;
+}
+
+// Queue an entry in its lane or in the deadline heap. fullMutex_ must be held.
+void SimpleMemoryManager::pushEntry(laneEntry &entry) {
+
+	if ( entry.tag.lane < 0 ) entry.tag.lane = 0;
+	if ( entry.tag.lane >= lanes_ ) entry.tag.lane = lanes_ - 1;
+
+	entry.seq = seq_++;
+	if ( mode_ == MODE_PRIORITY ) {
+		laneQueue_[entry.tag.lane * pool_size + laneHead_[entry.tag.lane]] = entry;
+		laneHead_[entry.tag.lane] = (laneHead_[entry.tag.lane] + 1) % pool_size;
+		++laneCount_[entry.tag.lane];
+	} else {
+		deadlineHeap_.push_back(entry);
+		std::push_heap(deadlineHeap_.begin(), deadlineHeap_.end(), laterDeadline);
+	}
+}
+
+// Take the next entry to serve, from the first lane that holds one or from the
+// top of the deadline heap. Returns false if nothing is queued. fullMutex_
+// must be held.
+bool SimpleMemoryManager::popEntry(laneEntry *entry) {
+	int lane;
+
+	if ( mode_ == MODE_PRIORITY ) {
+		for ( lane = 0; lane < lanes_ && laneCount_[lane] == 0; ++lane)
+			;
+		if ( lane == lanes_ )
+			return false;
+		*entry = laneQueue_[lane * pool_size + laneTail_[lane]];
+		laneTail_[lane] = (laneTail_[lane] + 1) % pool_size;
+		--laneCount_[lane];
+	} else {
+		if ( deadlineHeap_.empty() )
+			return false;
+		std::pop_heap(deadlineHeap_.begin(), deadlineHeap_.end(), laterDeadline);
+		*entry = deadlineHeap_.back();
+		deadlineHeap_.pop_back();
+	}
+
+	return true;
+}
+
+void SimpleMemoryManager::setQueueMode(queueMode mode, int lanes) {
+	std::vector<laneEntry> queued;
+	laneEntry entry;
+	int index;
+
+	if ( lanes < 1 ) lanes = 1;
+
+	fullMutex_.lock();
+
+	// Take out what is queued, in the order it would have been served
+	if ( mode_ == MODE_FIFO ) {
+		for ( index = 0; index < fullCount - stops_; ++index) {
+			entry.buffer = fullQueue[(fullTail + index) % pool_size];
+			entry.tag.lane = lanes - 1;
+			entry.tag.deadline = LLONG_MAX;
+			entry.queued = now();
+			queued.push_back(entry);
+		}
+		fullHead = fullTail = 0;
+	} else
+		while ( popEntry(&entry) )
+			queued.push_back(entry);
+
+	free(laneQueue_);
+	free(laneHead_);
+	free(laneTail_);
+	free(laneCount_);
+	laneQueue_ = NULL;
+	laneHead_ = laneTail_ = laneCount_ = NULL;
+
+	mode_ = mode;
+	lanes_ = lanes;
+
+	// Any lane may end up holding the whole pool
+	if ( mode_ == MODE_PRIORITY ) {
+		laneQueue_ = (laneEntry *)malloc(lanes_ * pool_size * sizeof(laneEntry));
+		laneHead_ = (int *)malloc(lanes_ * sizeof(int));
+		laneTail_ = (int *)malloc(lanes_ * sizeof(int));
+		laneCount_ = (int *)malloc(lanes_ * sizeof(int));
+		for ( index = 0; index < lanes_; ++index)
+			laneHead_[index] = laneTail_[index] = laneCount_[index] = 0;
+	}
+	deadlineHeap_.clear();
+	if ( mode_ == MODE_DEADLINE )
+		deadlineHeap_.reserve(pool_size);
+
+	// Put them back, keeping their tags
+	for ( index = 0; index < (int)queued.size(); ++index)
+		if ( mode_ == MODE_FIFO ) {
+			fullQueue[fullHead] = queued[index].buffer;
+			fullHead = (fullHead + 1) % pool_size;
+		} else
+			pushEntry(queued[index]);
+
+	stats_.assign(lanes_, laneStats());
+	for ( index = 0; index < lanes_; ++index) {
+		stats_[index].dequeued = 0;
+		stats_[index].totalWait = 0;
+		stats_[index].maxWait = 0;
+		stats_[index].missed = 0;
+	}
+
+	fullMutex_.unlock();
+}
+
+// Untagged buffers are bulk traffic: last lane, no deadline
+bufferTag SimpleMemoryManager::getDefaultTag() {
+	bufferTag tag;
+
+	tag.lane = lanes_ - 1;
+	tag.deadline = LLONG_MAX;
+
+	return tag;
+}
+
+int SimpleMemoryManager::putFullBuffer(void *buffer, bufferTag tag) {
+	laneEntry entry;
+
+	if ( mode_ == MODE_FIFO || buffer == NULL )
+		return putFullBuffer(buffer);
+
+	entry.buffer = buffer;
+	entry.tag = tag;
+	entry.queued = now();
+
+	fullMutex_.lock();
+
+	++fullCount;
+	pushEntry(entry);
+
+	fullMutex_.unlock();
+
+	fullSema_->notify();
+
+	return pool_size - fullCount;
+}
+
+void *SimpleMemoryManager::getFullBuffer(bufferTag *tag) {
+	laneEntry entry;
+	laneStats *stats;
+	long long wait, served;
+
+	if ( mode_ == MODE_FIFO ) {
+		if ( tag ) *tag = getDefaultTag();
+		return getFullBuffer();
+	}
+
+	fullMutex_.lock();
+
+	if ( fullCount == stops_ ) {
+		--fullCount;
+		--stops_;
+		fullMutex_.unlock();
+		if ( tag ) *tag = getDefaultTag();
+		return NULL;
+	}
+	if ( ! popEntry(&entry) ) {
+		fullMutex_.unlock();
+		std::cout << "SimpleMemoryManager::getFullBuffer() - ERROR no buffer queued" << std::endl;
+		return NULL;
+	}
+	--fullCount;
+
+	served = now();
+	wait = served - entry.queued;
+	stats = &stats_[entry.tag.lane];
+	++stats->dequeued;
+	stats->totalWait += wait;
+	if ( wait > stats->maxWait ) stats->maxWait = wait;
+	if ( served > entry.tag.deadline ) ++stats->missed;
+
+	fullMutex_.unlock();
+
+	if ( tag ) *tag = entry.tag;
+
+	return entry.buffer;
+}
+
+laneStats SimpleMemoryManager::getLaneStats(int lane) {
+	laneStats stats;
+
+	fullMutex_.lock();
+	if ( lane >= 0 && lane < (int)stats_.size() )
+		stats = stats_[lane];
+	else
+		stats.dequeued = stats.totalWait = stats.maxWait = stats.missed = 0;
+	fullMutex_.unlock();
+
+	return stats;
 }
@@ -5,6 +5,7 @@
 
 #include <mutex>
 #include <condition_variable>
+#include <vector>
         
 class Semaphore {
 public:
@@ -19,6 +20,11 @@ public:
         //notify the waiting thread
         cv.notify_one();
     }
+    inline void notify(int n) {
+        std::unique_lock<std::mutex> lock(mtx);
+        count += n;
+        cv.notify_all();
+    }
     inline void wait( ) {
         std::unique_lock<std::mutex> lock(mtx);
         while(count == 0) {
@@ -27,12 +33,63 @@ public:
         }
         count--;
     }
+    inline bool tryWait( ) {
+        std::unique_lock<std::mutex> lock(mtx);
+        if(count == 0)
+            return false;
+        count--;
+        return true;
+    }
 private:
     std::mutex mtx;
     std::condition_variable cv;
     int count;
 };
 
+// Releases the waiting threads once count threads have arrived
+class Barrier {
+public:
+    Barrier (int count_ = 0)
+    : count(count_)
+    {
+    }
+
+    inline void arrive( ) {
+        std::unique_lock<std::mutex> lock(mtx);
+        if(--count <= 0)
+            cv.notify_all();
+    }
+    inline void wait( ) {
+        std::unique_lock<std::mutex> lock(mtx);
+        while(count > 0) {
+            cv.wait(lock);
+        }
+    }
+    inline void arriveAndWait( ) {
+        arrive();
+        wait();
+    }
+private:
+    std::mutex mtx;
+    std::condition_variable cv;
+    int count;
+};
+
+// Class of service of a loaded buffer. In priority mode lower lanes are served
+// first; in deadline mode the earliest deadline (steady clock, nanoseconds) is.
+typedef struct {
+	   int		lane;
+	   long long	deadline;
+} bufferTag;
+
+// Per lane queue statistics, wait times in nanoseconds
+typedef struct {
+	   unsigned long long	dequeued;
+	   long long		totalWait;
+	   long long		maxWait;
+	   unsigned long long	missed;		// Served after their deadline
+} laneStats;
+
 class SimpleMemoryManager {
 
 	   public:
@@ -41,6 +98,8 @@ class SimpleMemoryManager {
 
 			 ~SimpleMemoryManager();
 
+			 // A NULL put in the full queue tells a stage instance to end. It is
+			 // only handed out when no loaded buffer is queued.
 			 void *getFreeBuffer();			// Return an empty buffer
 			 void *getFullBuffer();			// Return a loaded buffer
 			 int putFullBuffer(void *buffer);	// Queue a loaded buffer
@@ -51,9 +110,33 @@ class SimpleMemoryManager {
 			 int getFullCount();			// Get the number of loaded buffers
 			 void waitForFull();			// Wait for data to be available
 			 void waitForFree();			// Wait for a empty buffer to became available
+			 bool tryWaitForFree();			// Like waitForFree but returns false instead of blocking
+			 // Wait until every buffer is back in the free queue. A pool created
+			 // with size 0 starts with none, so it only returns once all pool_size
+			 // buffers have been loaded.
 			 void waitForDone();
 			 void waitForEmpty();
 			 void loadMemoryManager(void *buffer);
+			 // Load count buffers at once, touching the first touchSize bytes of each
+			 // so their pages are faulted in before the pipe runs. Only as many as
+			 // the free queue has room for are loaded; returns that number.
+			 int loadMemoryManager(void **buffers, int count, size_t touchSize = 0);
+
+			 // How the loaded buffers are served. MODE_FIFO is the default; in the
+			 // other modes buffers put without a tag go to the last lane with no
+			 // deadline. Buffers already queued are kept with their tags, the
+			 // ones queued in FIFO mode join the last lane.
+			 enum queueMode { MODE_FIFO, MODE_PRIORITY, MODE_DEADLINE };
+			 void setQueueMode(queueMode mode, int lanes = 1);
+			 queueMode getQueueMode() { return mode_; }
+			 int getLanes() { return lanes_; }
+
+			 int putFullBuffer(void *buffer, bufferTag tag);	// Queue a loaded buffer in its lane
+			 void *getFullBuffer(bufferTag *tag);		// Return the next loaded buffer and its tag
+			 bufferTag getDefaultTag();
+			 laneStats getLaneStats(int lane);
+
+			 static long long now();			// Steady clock in nanoseconds, for deadlines
 
 
 	   private:
@@ -62,6 +145,7 @@ class SimpleMemoryManager {
 			 int pool_size;
 			 int freeCount;
 			 int fullCount;
+			 int stops_;			// NULLs counted in fullCount
 			 int freeHead, freeTail;
 			 int fullHead, fullTail;
 			 void **freeQueue, **fullQueue;
@@ -69,8 +153,28 @@ class SimpleMemoryManager {
 			 std::mutex fullMutex_;
 			 std::mutex freeMutex_;
 			 std::mutex emptyMutex_;
+			 std::condition_variable doneCv_;	// Signaled when every buffer is free
 			 Semaphore   *fullSema_;
 			 Semaphore   *freeSema_;
 
+			 typedef struct {
+				    void		*buffer;
+				    bufferTag		tag;
+				    long long		queued;
+				    unsigned long long	seq;
+			 } laneEntry;
+
+			 static bool laterDeadline(const laneEntry &a, const laneEntry &b);
+			 void pushEntry(laneEntry &entry);
+			 bool popEntry(laneEntry *entry);
+
+			 queueMode mode_;
+			 int lanes_;
+			 laneEntry *laneQueue_;		// lanes_ rings of pool_size entries
+			 int *laneHead_, *laneTail_, *laneCount_;
+			 std::vector<laneEntry> deadlineHeap_;
+			 unsigned long long seq_;
+			 std::vector<laneStats> stats_;
+
 };
 #endif
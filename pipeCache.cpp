@@ -0,0 +1,194 @@
+#include "pipeCache.h"
+#include <string.h>
+
+pipeCache::pipeCache(size_t capacity, size_t inSize, size_t outSize, int shards)
+: inSize_(inSize), outSize_(outSize), hits_(0), misses_(0), evictions_(0) {
+
+	// Every shard holds at least one entry and they add up to capacity, so a
+	// small cache has fewer shards
+	if ( capacity < 1 ) capacity = 1;
+	if ( shards < 1 ) shards = 1;
+	if ( (size_t)shards > capacity ) shards = capacity;
+	shardCount_ = shards;
+
+	shards_ = new shard[shardCount_];
+	for (int i = 0; i < shardCount_; ++i) {
+		size_t perShard = capacity / shardCount_ + ( (size_t)i < capacity % shardCount_ ? 1 : 0 );
+
+		shards_[i].hand = 0;
+		shards_[i].entries.resize(perShard);
+		shards_[i].index.reserve(perShard);
+		for (size_t e = 0; e < perShard; ++e) {
+			shards_[i].entries[e].used = false;
+			shards_[i].entries[e].referenced = false;
+			shards_[i].entries[e].data = (char *)malloc(inSize_ + outSize_);
+		}
+	}
+}
+
+pipeCache::~pipeCache() {
+
+	for (int i = 0; i < shardCount_; ++i)
+		for (size_t e = 0; e < shards_[i].entries.size(); ++e)
+			free(shards_[i].entries[e].data);
+
+	delete [] shards_;
+}
+
+size_t pipeCache::getCapacity() {
+	size_t entries = 0;
+
+	for (int i = 0; i < shardCount_; ++i)
+		entries += shards_[i].entries.size();
+
+	return entries;
+}
+
+// 64 bit multiply/xor-shift hash, eight bytes at a time
+uint64_t pipeCache::hash(const void *data, size_t size) {
+	const unsigned char *bytes = (const unsigned char *)data;
+	const uint64_t mul = 0x9E3779B97F4A7C15ULL;
+	uint64_t h = size * mul;
+	uint64_t word;
+	size_t i = 0;
+
+	for ( ; i + 8 <= size; i += 8) {
+		memcpy(&word, bytes + i, 8);
+		h = (h ^ (word * mul)) * mul;
+		h ^= h >> 29;
+	}
+	if ( i < size ) {
+		word = 0;
+		memcpy(&word, bytes + i, size - i);
+		h = (h ^ (word * mul)) * mul;
+	}
+
+	h ^= h >> 32;
+	h *= 0xD6E8FEB86659FD93ULL;
+	h ^= h >> 32;
+
+	return h;
+}
+
+bool pipeCache::lookup(uint64_t key, const void *input, void *output) {
+	shard *current = getShard(key);
+	std::lock_guard<std::mutex> lock(current->lock);
+	std::unordered_map< uint64_t, size_t >::iterator it = current->index.find(key);
+
+	if ( it != current->index.end() ) {
+		entry &found = current->entries[it->second];
+
+		if ( memcmp(found.data, input, inSize_) == 0 ) {
+			memcpy(output, found.data + inSize_, outSize_);
+			found.referenced = true;
+			++hits_;
+			return true;
+		}
+	}
+
+	++misses_;
+
+	return false;
+}
+
+void pipeCache::insert(uint64_t key, const void *input, const void *output) {
+	shard *current = getShard(key);
+	std::lock_guard<std::mutex> lock(current->lock);
+	std::unordered_map< uint64_t, size_t >::iterator it = current->index.find(key);
+	size_t victim;
+
+	// Another instance may have computed it first, or the key collided
+	if ( it != current->index.end() )
+		victim = it->second;
+	else {
+		// CLOCK: skip the entries used since the hand last passed them
+		for (;;) {
+			entry &candidate = current->entries[current->hand];
+
+			if ( ! candidate.used || ! candidate.referenced )
+				break;
+			candidate.referenced = false;
+			current->hand = (current->hand + 1) % current->entries.size();
+		}
+
+		victim = current->hand;
+		current->hand = (current->hand + 1) % current->entries.size();
+
+		if ( current->entries[victim].used ) {
+			current->index.erase(current->entries[victim].key);
+			++evictions_;
+		}
+		current->index[key] = victim;
+	}
+
+	entry &slot = current->entries[victim];
+	slot.key = key;
+	slot.used = true;
+	slot.referenced = false;
+	memcpy(slot.data, input, inSize_);
+	memcpy(slot.data + inSize_, output, outSize_);
+}
+
+cacheStage::cacheStage(PipeBase *stage, size_t inSize, size_t outSize, size_t capacity,
+		       size_t inOffset, size_t outOffset, int shards)
+: span_(1, stage), inSize_(inSize), outSize_(outSize), inOffset_(inOffset), outOffset_(outOffset),
+  owner_(true), cache_(new pipeCache(capacity, inSize, outSize, shards)), input_(inSize) {}
+
+cacheStage::cacheStage(const std::vector<PipeBase*> &span, size_t inSize, size_t outSize, size_t capacity,
+		       size_t inOffset, size_t outOffset, int shards)
+: span_(span), inSize_(inSize), outSize_(outSize), inOffset_(inOffset), outOffset_(outOffset),
+  owner_(true), cache_(new pipeCache(capacity, inSize, outSize, shards)), input_(inSize) {}
+
+// Clones get their own copy of the wrapped stages and share the cache
+cacheStage::cacheStage(const cacheStage *parent)
+: inSize_(parent->inSize_), outSize_(parent->outSize_), inOffset_(parent->inOffset_), outOffset_(parent->outOffset_),
+  owner_(false), cache_(parent->cache_), input_(parent->inSize_) {
+
+	for (size_t i = 0; i < parent->span_.size(); ++i)
+		span_.push_back(parent->span_[i]->clone());
+}
+
+cacheStage::~cacheStage() {
+
+	if ( owner_ )
+		delete cache_;
+	else
+		for (size_t i = 0; i < span_.size(); ++i)
+			delete span_[i];
+}
+
+cacheStage * cacheStage::clone() const { return new cacheStage(this); }
+
+bool cacheStage::init() {
+
+	for (size_t i = 0; i < span_.size(); ++i)
+		if ( ! span_[i]->init() )
+			return false;
+
+	return true;
+}
+
+void cacheStage::end() {
+
+	for (size_t i = 0; i < span_.size(); ++i)
+		span_[i]->end();
+}
+
+bool cacheStage::run(void *data) {
+	char *buffer = (char *)data;
+	uint64_t key = pipeCache::hash(buffer + inOffset_, inSize_);
+
+	if ( cache_->lookup(key, buffer + inOffset_, buffer + outOffset_) )
+		return true;
+
+	// The stages may overwrite the input, keep it for the cache
+	memcpy(input_.data(), buffer + inOffset_, inSize_);
+
+	for (size_t i = 0; i < span_.size(); ++i)
+		if ( ! span_[i]->run(data) )
+			return false;
+
+	cache_->insert(key, input_.data(), buffer + outOffset_);
+
+	return true;
+}
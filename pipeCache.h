@@ -0,0 +1,95 @@
+// pipeCache.h
+
+#ifndef _pipeCache_h_
+#define _pipeCache_h_
+
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include "pipeExec.h"
+
+// Bounded cache of stage outputs keyed by the stage input. It is split in
+// shards, each with its own lock, and every shard evicts with the CLOCK
+// algorithm. The input is kept with the output so a hash collision is a miss.
+// It never holds more than capacity entries.
+class pipeCache {
+
+	   public:
+
+			 pipeCache(size_t capacity, size_t inSize, size_t outSize, int shards = 16);
+
+			 ~pipeCache();
+
+			 static uint64_t hash(const void *data, size_t size);
+
+			 // Copies the cached output for input to output. Returns false on a miss.
+			 bool lookup(uint64_t key, const void *input, void *output);
+			 void insert(uint64_t key, const void *input, const void *output);
+
+			 unsigned long long getHits() { return hits_; }
+			 unsigned long long getMisses() { return misses_; }
+			 unsigned long long getEvictions() { return evictions_; }
+			 size_t getCapacity();			// Entries held by all the shards
+
+	   private:
+
+			 typedef struct {
+				    uint64_t	key;
+				    bool		used;
+				    bool		referenced;	// Second chance bit for CLOCK
+				    char		*data;		// Input followed by output
+			 } entry;
+
+			 typedef struct {
+				    std::mutex	lock;
+				    std::vector<entry>	entries;
+				    std::unordered_map< uint64_t, size_t >	index;
+				    size_t		hand;
+			 } shard;
+
+			 shard *getShard(uint64_t key) { return &shards_[(key >> 48) % shardCount_]; }
+
+			 size_t inSize_, outSize_;
+			 int shardCount_;
+			 shard *shards_;
+			 std::atomic<unsigned long long> hits_, misses_, evictions_;
+};
+
+// Wraps a stage, or a span of stages run one after the other, with a cache.
+// The inSize bytes at inOffset are hashed; on a hit the outSize bytes at
+// outOffset are copied from the cache and the stages are not run. A buffer is
+// only cached when every stage returns true.
+class cacheStage : public PipeBase {
+
+	   public:
+
+			 cacheStage(PipeBase *stage, size_t inSize, size_t outSize, size_t capacity,
+					  size_t inOffset = 0, size_t outOffset = 0, int shards = 16);
+			 cacheStage(const std::vector<PipeBase*> &span, size_t inSize, size_t outSize, size_t capacity,
+					  size_t inOffset = 0, size_t outOffset = 0, int shards = 16);
+			 ~cacheStage();
+
+			 bool init();
+			 bool run(void *data);
+			 void end();
+			 cacheStage * clone() const;
+
+			 unsigned long long getHits() { return cache_->getHits(); }
+			 unsigned long long getMisses() { return cache_->getMisses(); }
+			 unsigned long long getEvictions() { return cache_->getEvictions(); }
+			 size_t getCapacity() { return cache_->getCapacity(); }
+
+	   private:
+
+			 cacheStage(const cacheStage *parent);
+
+			 std::vector<PipeBase*> span_;
+			 size_t inSize_, outSize_, inOffset_, outOffset_;
+			 bool owner_;
+			 pipeCache *cache_;
+			 std::vector<char> input_;	// Input of the buffer being computed
+};
+
+#endif
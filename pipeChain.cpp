@@ -0,0 +1,309 @@
+#include "pipeChain.h"
+#include <new>
+#include <iostream>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// The segment data starts after the header, cache line aligned
+#define SEGMENT_HEADER	((sizeof(chainSegment) + 63) & ~(size_t)63)
+
+char *bufferChain::segmentData(chainSegment *segment) {
+	return (char *)segment + SEGMENT_HEADER;
+}
+
+void bufferChain::retain(chainSegment *segment) {
+	segment->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void bufferChain::release(chainSegment *segment) {
+	if ( segment->refs.fetch_sub(1, std::memory_order_acq_rel) == 1 )
+		segment->pool->putFreeBuffer(segment);
+}
+
+bufferChain::bufferChain(SimpleMemoryManager *pool)
+: pool_(NULL), size_(0) {
+
+	setPool(pool);
+}
+
+bufferChain::bufferChain(const bufferChain &other)
+: pool_(other.pool_), views_(other.views_), size_(other.size_) {
+
+	for (size_t i = 0; i < views_.size(); ++i)
+		retain(views_[i].segment);
+}
+
+bufferChain &bufferChain::operator=(const bufferChain &other) {
+
+	if ( this == &other )
+		return *this;
+
+	for (size_t i = 0; i < other.views_.size(); ++i)
+		retain(other.views_[i].segment);
+	clear();
+
+	pool_ = other.pool_;
+	views_ = other.views_;
+	size_ = other.size_;
+
+	return *this;
+}
+
+bufferChain::~bufferChain() {
+
+	clear();
+}
+
+void bufferChain::clear() {
+
+	for (size_t i = 0; i < views_.size(); ++i)
+		release(views_[i].segment);
+	views_.clear();
+	size_ = 0;
+}
+
+bool bufferChain::setPool(SimpleMemoryManager *pool) {
+
+	if ( pool != NULL && (size_t)pool->getBufferSize() <= SEGMENT_HEADER ) {
+		std::cout << "bufferChain::setPool() - ERROR buffers of " << pool->getBufferSize() << " bytes do not fit a segment header" << std::endl;
+		pool_ = NULL;
+		return false;
+	}
+
+	pool_ = pool;
+
+	return true;
+}
+
+// Takes a buffer from the pool, waiting for one if there is none free
+chainSegment *bufferChain::newSegment() {
+	chainSegment *segment;
+
+	pool_->waitForFree();
+	segment = (chainSegment *)pool_->getFreeBuffer();
+
+	new (&segment->refs) std::atomic<int>(1);
+	segment->pool = pool_;
+	segment->capacity = pool_->getBufferSize() - SEGMENT_HEADER;
+	segment->used = 0;
+
+	return segment;
+}
+
+void *bufferChain::appendSpace(size_t size) {
+	char *space;
+
+	if ( pool_ == NULL || size == 0 || size > pool_->getBufferSize() - SEGMENT_HEADER )
+		return NULL;
+
+	// The last view can only grow if it ends where the segment data ends and
+	// no other chain shares the segment
+	if ( views_.empty() ) {
+		view fresh = { newSegment(), 0, 0 };
+		views_.push_back(fresh);
+	} else {
+		view &last = views_.back();
+		chainSegment *segment = last.segment;
+
+		if ( last.offset + last.length != segment->used || segment->refs.load() != 1 ||
+		     segment->capacity - segment->used < size ) {
+			view fresh = { newSegment(), 0, 0 };
+			views_.push_back(fresh);
+		}
+	}
+
+	view &last = views_.back();
+	space = segmentData(last.segment) + last.segment->used;
+	last.segment->used += size;
+	last.length += size;
+	size_ += size;
+
+	return space;
+}
+
+void bufferChain::append(const void *data, size_t size) {
+	const char *bytes = (const char *)data;
+
+	while ( size && pool_ ) {
+		size_t room = 0;
+
+		if ( ! views_.empty() ) {
+			view &last = views_.back();
+			if ( last.offset + last.length == last.segment->used && last.segment->refs.load() == 1 )
+				room = last.segment->capacity - last.segment->used;
+		}
+		if ( room == 0 )
+			room = pool_->getBufferSize() - SEGMENT_HEADER;
+		if ( room > size )
+			room = size;
+
+		memcpy(appendSpace(room), bytes, room);
+		bytes += room;
+		size -= room;
+	}
+}
+
+void bufferChain::prepend(const void *data, size_t size) {
+	bufferChain header(pool_);
+
+	header.append(data, size);
+	prepend(header);
+}
+
+void bufferChain::append(const bufferChain &other) {
+	std::deque<view> views(other.views_);
+	size_t size = other.size_;
+
+	for (size_t i = 0; i < views.size(); ++i) {
+		retain(views[i].segment);
+		views_.push_back(views[i]);
+	}
+	size_ += size;
+}
+
+void bufferChain::prepend(const bufferChain &other) {
+	std::deque<view> views(other.views_);
+	size_t size = other.size_;
+
+	for (size_t i = views.size(); i > 0; --i) {
+		retain(views[i - 1].segment);
+		views_.push_front(views[i - 1]);
+	}
+	size_ += size;
+}
+
+bufferChain bufferChain::slice(size_t offset, size_t length) const {
+	bufferChain result(pool_);
+
+	for (size_t i = 0; i < views_.size() && length; ++i) {
+		view part = views_[i];
+
+		if ( offset >= part.length ) {
+			offset -= part.length;
+			continue;
+		}
+
+		part.offset += offset;
+		part.length -= offset;
+		offset = 0;
+		if ( part.length > length )
+			part.length = length;
+
+		retain(part.segment);
+		result.views_.push_back(part);
+		result.size_ += part.length;
+		length -= part.length;
+	}
+
+	return result;
+}
+
+bufferChain bufferChain::split(size_t offset) {
+	bufferChain rest(pool_);
+	size_t i;
+
+	if ( offset >= size_ )
+		return rest;
+
+	for ( i = 0; offset >= views_[i].length; ++i)
+		offset -= views_[i].length;
+
+	// The view holding the split point is shared by both chains
+	if ( offset ) {
+		view tail = views_[i];
+
+		tail.offset += offset;
+		tail.length -= offset;
+		views_[i].length = offset;
+		retain(tail.segment);
+		rest.views_.push_back(tail);
+		++i;
+	}
+
+	// The views after it move to the other chain with their references
+	rest.views_.insert(rest.views_.end(), views_.begin() + i, views_.end());
+	views_.erase(views_.begin() + i, views_.end());
+
+	for (i = 0; i < rest.views_.size(); ++i)
+		rest.size_ += rest.views_[i].length;
+	size_ -= rest.size_;
+
+	return rest;
+}
+
+size_t bufferChain::copyOut(void *data, size_t offset, size_t length) const {
+	char *bytes = (char *)data;
+	size_t copied = 0;
+
+	for (size_t i = 0; i < views_.size() && copied < length; ++i) {
+		size_t start, count;
+
+		if ( offset >= views_[i].length ) {
+			offset -= views_[i].length;
+			continue;
+		}
+
+		start = views_[i].offset + offset;
+		count = views_[i].length - offset;
+		if ( count > length - copied )
+			count = length - copied;
+		offset = 0;
+
+		memcpy(bytes + copied, segmentData(views_[i].segment) + start, count);
+		copied += count;
+	}
+
+	return copied;
+}
+
+ssize_t bufferChain::writeTo(int fd) const {
+	struct iovec iov[IOV_MAX < 256 ? IOV_MAX : 256];
+	const int maxIov = sizeof(iov) / sizeof(iov[0]);
+	size_t index = 0, skip = 0, total = 0;
+
+	while ( index < views_.size() ) {
+		int count = 0;
+		ssize_t written;
+
+		// Skip the part of the current view already written and empty views
+		for (size_t i = index; i < views_.size() && count < maxIov; ++i) {
+			size_t start = ( i == index ) ? skip : 0;
+			if ( views_[i].length == start )
+				continue;
+			iov[count].iov_base = segmentData(views_[i].segment) + views_[i].offset + start;
+			iov[count].iov_len = views_[i].length - start;
+			++count;
+		}
+		if ( count == 0 )
+			break;
+
+		if ( (written = writev(fd, iov, count)) < 0 ) {
+			if ( errno == EINTR ) continue;
+			return -1;
+		}
+		total += written;
+
+		// Move past what was written, which may end in the middle of a view,
+		// and past the empty views that follow it
+		while ( index < views_.size() && (written > 0 || views_[index].length == skip) ) {
+			size_t left = views_[index].length - skip;
+
+			if ( (size_t)written >= left ) {
+				written -= left;
+				++index;
+				skip = 0;
+			} else {
+				skip += written;
+				written = 0;
+			}
+		}
+	}
+
+	return total;
+}
@@ -0,0 +1,83 @@
+// pipeChain.h
+
+#ifndef _pipeChain_h_
+#define _pipeChain_h_
+
+#include <stddef.h>
+#include <atomic>
+#include <deque>
+#include <sys/types.h>
+#include "SimpleMemoryManager.h"
+
+// A pool buffer used as a chain segment. The header lives at the start of
+// the buffer itself, so making a segment only takes a buffer from the pool.
+// The buffer goes back to its pool when the last chain using it releases it.
+typedef struct {
+	   std::atomic<int>	refs;
+	   SimpleMemoryManager	*pool;
+	   size_t		capacity;	// Bytes after the header
+	   size_t		used;		// Bytes written so far
+} chainSegment;
+
+// A list of views over reference counted segments. Prepending, appending,
+// slicing and splitting only add or drop views, the bytes are not copied.
+// Chains are cheap to copy: the copy shares the segments.
+//
+// To move chains through a pipe, load the pipe head with bufferChain objects
+// and let the stages draw segments from a separate pool created with a size.
+class bufferChain {
+
+	   public:
+
+			 bufferChain(SimpleMemoryManager *pool = NULL);
+			 bufferChain(const bufferChain &other);
+			 bufferChain &operator=(const bufferChain &other);
+			 ~bufferChain();
+
+			 // The pool buffers must be larger than the segment header. A pool
+			 // with smaller buffers is rejected and the chain is left without one.
+			 bool setPool(SimpleMemoryManager *pool);
+
+			 size_t size() const { return size_; }
+			 size_t getSegmentCount() const { return views_.size(); }
+			 void clear();
+
+			 // Copy bytes in, filling the room left in the last segment first
+			 void append(const void *data, size_t size);
+			 void prepend(const void *data, size_t size);
+
+			 // Room for size bytes (at most a segment) at the end, to be written in
+			 // place. Returns NULL for a size of 0, more than a segment or no pool.
+			 void *appendSpace(size_t size);
+
+			 // Link the segments of other, without copying
+			 void append(const bufferChain &other);
+			 void prepend(const bufferChain &other);
+
+			 bufferChain slice(size_t offset, size_t length) const;
+			 bufferChain split(size_t offset);	// Keeps [0, offset) and returns the rest
+
+			 size_t copyOut(void *data, size_t offset, size_t length) const;
+
+			 // Writes the chain with writev, returns the bytes written or -1
+			 ssize_t writeTo(int fd) const;
+
+	   private:
+
+			 typedef struct {
+				    chainSegment	*segment;
+				    size_t		offset;
+				    size_t		length;
+			 } view;
+
+			 chainSegment *newSegment();
+			 static char *segmentData(chainSegment *segment);
+			 static void retain(chainSegment *segment);
+			 static void release(chainSegment *segment);
+
+			 SimpleMemoryManager *pool_;
+			 std::deque<view> views_;
+			 size_t size_;
+};
+
+#endif
@@ -0,0 +1,364 @@
+#include "pipeCheckpoint.h"
+#include <iostream>
+#include <map>
+#include <climits>
+#include <string.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC	0x504b4350	// "PCKP"
+
+// Record types in the log
+enum { REC_BUFFER = 1, REC_RESET = 2, REC_EPOCH = 3 };
+
+typedef struct {
+	uint32_t magic;
+	uint32_t type;
+	uint64_t epoch;
+	uint32_t id;
+	int32_t stage;
+	uint32_t size;
+	int32_t lane;
+	int64_t budget;		// Nanoseconds left to the deadline, clocks are not kept across runs
+} recordHeader;
+
+static bool writeRecord(FILE *log, uint32_t type, uint64_t epoch, uint32_t id = 0, int stage = 0, const bufferTag *tag = NULL, const char *payload = NULL, uint32_t size = 0) {
+	recordHeader header;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = CHECKPOINT_MAGIC;
+	header.type = type;
+	header.epoch = epoch;
+	header.id = id;
+	header.stage = stage;
+	header.size = size;
+	if ( tag ) {
+		header.lane = tag->lane;
+		header.budget = tag->deadline == LLONG_MAX ? INT64_MAX : tag->deadline - SimpleMemoryManager::now();
+	}
+
+	if ( fwrite(&header, sizeof(header), 1, log) != 1 )
+		return false;
+	if ( size && fwrite(payload, size, 1, log) != 1 )
+		return false;
+
+	return true;
+}
+
+// Length of the log up to the end of its last complete snapshot
+static long completeLength(const char *path, uint64_t *epoch) {
+	recordHeader header;
+	long length = 0;
+	FILE *log;
+
+	if ( (log = fopen(path, "rb")) == NULL )
+		return 0;
+
+	while ( fread(&header, sizeof(header), 1, log) == 1 && header.magic == CHECKPOINT_MAGIC ) {
+		if ( header.size && fseek(log, header.size, SEEK_CUR) != 0 )
+			break;
+		if ( header.type == REC_EPOCH ) {
+			length = ftell(log);
+			*epoch = header.epoch;
+		}
+	}
+
+	fclose(log);
+
+	return length;
+}
+
+pipeCheckpoint::pipeCheckpoint(const char *path, size_t payloadSize, unsigned int intervalMs)
+: path_(path), payloadSize_(payloadSize), intervalMs_(intervalMs), maxLogSize_(64L * 1024 * 1024),
+  epoch_(0), slots_(NULL), slotCount_(0), running_(false), thread_(NULL) {
+
+	// A crash can leave a torn snapshot at the end. Cut it off before appending,
+	// or load() would stop there and never see the snapshots written after it.
+	long length = completeLength(path, &epoch_);
+
+	if ( (log_ = fopen(path, "ab")) == NULL ) {
+		std::cout << "pipeCheckpoint::pipeCheckpoint() - ERROR opening " << path << std::endl;
+		return;
+	}
+
+	fseek(log_, 0, SEEK_END);
+	if ( ftell(log_) != length && ftruncate(fileno(log_), length) != 0 )
+		std::cout << "pipeCheckpoint::pipeCheckpoint() - ERROR truncating " << path << std::endl;
+}
+
+pipeCheckpoint::~pipeCheckpoint() {
+
+	stop();
+
+	if ( log_ != NULL )
+		fclose(log_);
+
+	for (size_t i = 0; i < slotCount_; ++i)
+		free(slots_[i].payload);
+	delete [] slots_;
+}
+
+void pipeCheckpoint::reserve(int bufferCount) {
+
+	if ( slots_ != NULL )
+		return;
+
+	for (slotCount_ = 16; slotCount_ < 2 * (size_t)bufferCount; slotCount_ *= 2)
+		;
+
+	slots_ = new slot[slotCount_];
+	for (size_t i = 0; i < slotCount_; ++i) {
+		slots_[i].buffer = NULL;
+		slots_[i].stage = -1;
+		slots_[i].version = 0;
+		slots_[i].saved = 0;
+		slots_[i].payload = NULL;
+	}
+}
+
+// Buffers are recycled by the pool, so each one claims a slot the first time
+// it is seen and keeps it for the life of the checkpoint. The table is never
+// more than half full, so a probe always ends on the buffer or a free slot.
+pipeCheckpoint::slot *pipeCheckpoint::findSlot(void *buffer) {
+	size_t mask = slotCount_ - 1;
+	size_t index = (size_t)(((uintptr_t)buffer >> 4) * 0x9E3779B97F4A7C15ULL >> 32) & mask;
+
+	for (size_t probe = 0; probe < slotCount_; ++probe, index = (index + 1) & mask) {
+		void *key = slots_[index].buffer.load(std::memory_order_acquire);
+
+		if ( key == NULL && slots_[index].buffer.compare_exchange_strong(key, buffer) )
+			return &slots_[index];
+		if ( key == buffer )
+			return &slots_[index];
+	}
+
+	return NULL;
+}
+
+void pipeCheckpoint::completed(void *buffer, const std::atomic<int> &stage, bool isTail, bufferTag tag) {
+	slot *current;
+
+	if ( slots_ == NULL || (current = findSlot(buffer)) == NULL )
+		return;
+
+	std::lock_guard<std::mutex> lock(current->lock);
+
+	// Once the tail is done the buffer is no longer in flight
+	if ( isTail )
+		current->stage = -1;
+	else {
+		if ( current->payload == NULL )
+			current->payload = (char *)malloc(payloadSize_);
+		memcpy(current->payload, buffer, payloadSize_);
+		current->stage = stage.load();
+		current->tag = tag;
+	}
+	++current->version;
+}
+
+void pipeCheckpoint::removeStage(int stage, std::vector< std::atomic<int>* > &positions) {
+
+	for (size_t i = 0; i < slotCount_; ++i)
+		slots_[i].lock.lock();
+
+	for (size_t i = 0; i < positions.size(); ++i)
+		--*positions[i];
+
+	for (size_t i = 0; i < slotCount_; ++i) {
+		slot *current = &slots_[i];
+
+		if ( current->stage >= stage ) {
+			--current->stage;
+			++current->version;
+		}
+		current->lock.unlock();
+	}
+}
+
+// Writes and syncs a snapshot. The slots written are returned in written and
+// only count as saved once the caller calls markSaved(), so a failed write
+// leaves them dirty for the next snapshot. Returns -1 on a write error.
+int pipeCheckpoint::writeSnapshot(FILE *log, bool full, savedList &written) {
+	int count = 0;
+
+	written.clear();
+
+	++epoch_;
+	if ( full && ! writeRecord(log, REC_RESET, epoch_) )
+		return -1;
+
+	for (size_t i = 0; i < slotCount_; ++i) {
+		slot *current = &slots_[i];
+		bool ok = true;
+
+		if ( current->buffer.load(std::memory_order_acquire) == NULL )
+			continue;
+
+		std::lock_guard<std::mutex> lock(current->lock);
+
+		if ( full ? current->stage != -1 : current->version != current->saved ) {
+			if ( current->stage == -1 )
+				ok = writeRecord(log, REC_BUFFER, epoch_, i, -1);
+			else
+				ok = writeRecord(log, REC_BUFFER, epoch_, i, current->stage, &current->tag, current->payload, payloadSize_);
+			++count;
+		}
+		if ( ! ok )
+			return -1;
+
+		written.push_back(std::make_pair(current, current->version));
+	}
+
+	if ( ! writeRecord(log, REC_EPOCH, epoch_) || fflush(log) != 0 || fdatasync(fileno(log)) != 0 )
+		return -1;
+
+	return count;
+}
+
+// A slot completed again while the snapshot was written stays dirty
+void pipeCheckpoint::markSaved(const savedList &written) {
+
+	for (size_t i = 0; i < written.size(); ++i) {
+		std::lock_guard<std::mutex> lock(written[i].first->lock);
+		written[i].first->saved = written[i].second;
+	}
+}
+
+// Rewrite the log as a single full snapshot. The new log replaces the old one
+// with a rename, so there is always a complete log on disk.
+bool pipeCheckpoint::compact() {
+	std::string tmpPath = path_ + ".tmp";
+	savedList written;
+	FILE *tmp;
+	bool ok;
+
+	if ( (tmp = fopen(tmpPath.c_str(), "wb")) == NULL )
+		return false;
+
+	ok = writeSnapshot(tmp, true, written) >= 0;
+	if ( fclose(tmp) != 0 || ! ok || rename(tmpPath.c_str(), path_.c_str()) != 0 ) {
+		unlink(tmpPath.c_str());
+		return false;
+	}
+
+	markSaved(written);
+
+	fclose(log_);
+	if ( (log_ = fopen(path_.c_str(), "ab")) == NULL )
+		std::cout << "pipeCheckpoint::compact() - ERROR reopening " << path_ << std::endl;
+
+	return true;
+}
+
+int pipeCheckpoint::snapshot(bool full) {
+	std::lock_guard<std::mutex> lock(logMutex_);
+	savedList written;
+	long start;
+	int count;
+
+	if ( log_ == NULL )
+		return -1;
+
+	if ( (start = ftell(log_)) > maxLogSize_ && compact() )
+		return 0;
+
+	// Cut a partly written snapshot off, so the next one is not appended
+	// after a torn record that would hide it from load()
+	if ( (count = writeSnapshot(log_, full, written)) < 0 ) {
+		std::cout << "pipeCheckpoint::snapshot() - ERROR writing " << path_ << std::endl;
+		clearerr(log_);
+		if ( ftruncate(fileno(log_), start) != 0 )
+			std::cout << "pipeCheckpoint::snapshot() - ERROR truncating " << path_ << std::endl;
+		return -1;
+	}
+
+	markSaved(written);
+
+	return count;
+}
+
+void pipeCheckpoint::snapshotThread() {
+	std::unique_lock<std::mutex> lock(threadMutex_);
+
+	while ( running_ ) {
+		wakeUp_.wait_for(lock, std::chrono::milliseconds(intervalMs_));
+		if ( ! running_ ) break;
+
+		lock.unlock();
+		snapshot();
+		lock.lock();
+	}
+}
+
+void pipeCheckpoint::start() {
+
+	if ( thread_ != NULL )
+		return;
+
+	snapshot(true);
+
+	running_ = true;
+	thread_ = new std::thread(&pipeCheckpoint::snapshotThread, this);
+}
+
+void pipeCheckpoint::stop() {
+
+	if ( thread_ == NULL )
+		return;
+
+	threadMutex_.lock();
+	running_ = false;
+	threadMutex_.unlock();
+	wakeUp_.notify_one();
+
+	thread_->join();
+	delete thread_;
+	thread_ = NULL;
+
+	snapshot();
+}
+
+// Replays the log keeping the state of every slot. A snapshot only counts
+// once its epoch marker has been read; a reset discards the previous state.
+int pipeCheckpoint::load(std::vector<checkpointRecord> &records) {
+	std::map< uint32_t, checkpointRecord > committed, pending;
+	bool reset = false;
+	recordHeader header;
+	FILE *log;
+
+	records.clear();
+
+	if ( (log = fopen(path_.c_str(), "rb")) == NULL )
+		return 0;
+
+	while ( fread(&header, sizeof(header), 1, log) == 1 && header.magic == CHECKPOINT_MAGIC ) {
+		if ( header.type == REC_BUFFER ) {
+			checkpointRecord &record = pending[header.id];
+			record.stage = header.stage;
+			record.tag.lane = header.lane;
+			record.tag.deadline = header.budget == INT64_MAX ? LLONG_MAX : SimpleMemoryManager::now() + header.budget;
+			record.payload.resize(header.size);
+			if ( header.size && fread(record.payload.data(), header.size, 1, log) != 1 )
+				break;
+		}
+		else if ( header.type == REC_RESET ) {
+			pending.clear();
+			reset = true;
+		}
+		else if ( header.type == REC_EPOCH ) {
+			if ( reset )
+				committed.clear();
+			for (std::map< uint32_t, checkpointRecord >::iterator it = pending.begin(); it != pending.end(); ++it)
+				committed[it->first] = it->second;
+			pending.clear();
+			reset = false;
+		}
+	}
+
+	fclose(log);
+
+	for (std::map< uint32_t, checkpointRecord >::iterator it = committed.begin(); it != committed.end(); ++it)
+		if ( it->second.stage != -1 && it->second.payload.size() == payloadSize_ )
+			records.push_back(it->second);
+
+	return records.size();
+}
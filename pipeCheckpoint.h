@@ -0,0 +1,109 @@
+// pipeCheckpoint.h
+
+#ifndef _pipeCheckpoint_h_
+#define _pipeCheckpoint_h_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "SimpleMemoryManager.h"
+
+// A buffer saved in the checkpoint log: the last stage that completed it, its
+// tag and its payload at that point. The log keeps the time that was left to
+// the deadline when the snapshot was written, and load turns it back into a
+// deadline from the time it is read.
+typedef struct {
+	   int			stage;
+	   bufferTag		tag;
+	   std::vector<char>	payload;
+} checkpointRecord;
+
+// Keeps the position and payload of every buffer in flight in the pipe and
+// periodically appends the buffers that changed to a log file. Every snapshot
+// ends with an epoch marker, so a crash in the middle of one only loses that
+// snapshot. Stages copy the payload to a private slot when they complete a
+// buffer. Each buffer gets its slot once, from a table looked up without
+// locks; the only lock is the slot's own, shared with the snapshot thread
+// while it writes that slot.
+class pipeCheckpoint {
+
+	   public:
+
+			 // payloadSize bytes of each buffer are saved, every intervalMs milliseconds
+			 pipeCheckpoint(const char *path, size_t payloadSize, unsigned int intervalMs = 1000);
+
+			 ~pipeCheckpoint();
+
+			 bool isOpen() { return log_ != NULL; }
+
+			 // Makes room for bufferCount buffers. Called by pipeExec::setCheckpoint
+			 // with the size of the head, before the pipe runs.
+			 void reserve(int bufferCount);
+
+			 // Called by the stage after its run() completes a buffer. The stage
+			 // is read under the slot lock, so removeStage can move it.
+			 void completed(void *buffer, const std::atomic<int> &stage, bool isTail, bufferTag tag);
+
+			 // Called by pipeExec::deleteNode. The buffers completed by the removed
+			 // stage or a later one move down one stage, and so do the positions
+			 // of the later stages, while no completion can be recorded. A buffer
+			 // only the removed first stage had completed is no longer in flight.
+			 void removeStage(int stage, std::vector< std::atomic<int>* > &positions);
+
+			 // Appends the buffers that changed since the last snapshot, or all of
+			 // them if full is true. Returns the number of buffers written.
+			 int snapshot(bool full = false);
+
+			 void start();		// Write a full snapshot and start the periodic thread
+			 void stop();		// Stop the periodic thread and write a last snapshot
+
+			 // Reads the buffers in flight at the last complete snapshot of the log
+			 int load(std::vector<checkpointRecord> &records);
+
+			 size_t getPayloadSize() { return payloadSize_; }
+
+			 void setMaxLogSize(long bytes) { maxLogSize_ = bytes; }
+
+	   private:
+
+			 typedef struct {
+				    std::atomic<void*>	buffer;		// Set once, when the buffer is first seen
+				    std::mutex	lock;
+				    int		stage;		// -1 once the tail has completed it
+				    bufferTag	tag;
+				    unsigned int	version;	// Bumped on every completion
+				    unsigned int	saved;		// Version of the last synced record
+				    char		*payload;
+			 } slot;
+
+			 typedef std::vector< std::pair<slot*, unsigned int> > savedList;
+
+			 slot *findSlot(void *buffer);
+			 int writeSnapshot(FILE *log, bool full, savedList &written);
+			 void markSaved(const savedList &written);
+			 bool compact();
+			 void snapshotThread();
+
+			 std::string path_;
+			 size_t payloadSize_;
+			 unsigned int intervalMs_;
+			 long maxLogSize_;
+			 FILE *log_;
+			 uint64_t epoch_;
+
+			 slot *slots_;			// Open addressing on the buffer address
+			 size_t slotCount_;		// Power of two, at least twice the buffers
+
+			 std::mutex logMutex_;
+			 std::mutex threadMutex_;
+			 std::condition_variable wakeUp_;
+			 bool running_;
+			 std::thread *thread_;
+};
+
+#endif
@@ -1,7 +1,9 @@
 #include "pipeExec.h"
+#include "pipeCheckpoint.h"
 #include <ostream>
+#include <string.h>
 
-// For use in deleteNode. Does nothing.
+// For use in deleteNode when the stage is the only one in the pipe. Does nothing.
 class nullFunc : public PipeBase {
 	   nullFunc * clone() const {
 			 return new nullFunc();
@@ -14,17 +16,20 @@ pipeExec::pipeExec(PipeBase *func, SimpleMemoryManager* mgrIn, int instances) {
 	   pipeExecArgs *element;
 
 	   // Create the HEAD node
-	   element = (pipeExecArgs*) malloc(sizeof(pipeExecArgs));
+	   element = new pipeExecArgs();
 	   element->instances = instances;
-	   element->currentInstance = 0;
 	   element->procFunc = func;
+	   element->currentHead = mgrIn;
 	   element->mgrIn  = mgrIn;
-	   element->mgrOut = new SimpleMemoryManager(0, mgrIn->getBufferCount());
+	   element->mgrOut = mgrIn; // Alone in the pipe it is also the TAIL
 	   element->isTail = true;
 	   element->switching = false;
 	   element->deleted = false;
+	   element->position = 0;
+	   element->checkpoint = NULL;
 	   execList.push_back(element);
 	   count = 0;
+	   checkpoint_ = NULL;
 }
 
 pipeExec::~pipeExec() {
@@ -36,11 +41,11 @@ pipeExec::~pipeExec() {
 	   // and should be deleted by the calling function where it has been
 	   // created
 	   for ( i = 0; i < execList.size() - 1; ++i) {
-			 delete execList[i]->mgrOut;
-			 free(execList[i]);
+			 delete execList[i]->mgrOut.load();
+			 delete execList[i];
 	   }
 
-	   free(execList[i]);
+	   delete execList[i];
 }
 
 //void pipeExec::addFunction(pipeExecFunc func, int instances)
@@ -48,56 +53,177 @@ void pipeExec::addFunction(PipeBase *func, int instances, bool splice) {
 	   pipeExecArgs *element;
 
 	   // Insert an element
-	   element = (pipeExecArgs*) malloc(sizeof(pipeExecArgs));
+	   element = new pipeExecArgs();
 	   element->instances = instances;
-	   element->currentInstance = 0;
 	   element->procFunc = func;
-	   execList[count]->mgrOut = new SimpleMemoryManager(0, execList[0]->mgrIn->getBufferCount());
-	   element->mgrIn  = execList[count]->mgrOut;
-	   element->mgrOut = execList[0]->mgrIn;
+	   element->currentHead = execList[0]->currentHead;
+	   execList[count]->mgrOut = new SimpleMemoryManager(0, execList[0]->currentHead->getBufferCount());
+	   execList[count]->mgrOut.load()->setQueueMode(execList[0]->currentHead->getQueueMode(), execList[0]->currentHead->getLanes());
+	   element->mgrIn  = execList[count]->mgrOut.load();
+	   element->mgrOut = execList[0]->currentHead;
 	   execList[count]->isTail = false;
 	   element->isTail = true;
 	   element->switching = false;
 	   element->deleted = false;
+	   element->position = execList.size();
+	   element->checkpoint = checkpoint_;
 	   execList.push_back(element);
 	   ++count;
 }
 
-static std::mutex launchMutex_;
+static thread_local bufferTag currentTag_ = { 0, 0 };
 
-void execElement(pipeExec::pipeExecArgs* localArgs) {
+bufferTag pipeExec::getCurrentTag() {
+
+	   return currentTag_;
+}
+
+// Replace a failing instance with a fresh clone of the stage. The clone is
+// initialized before the failing instance ends, so a stage that takes the end
+// of its last instance as the end of the stream, like transportSender, does
+// not see one in the middle of it. If the clone cannot be initialized the
+// failing instance is kept and false is returned.
+static bool restartStage(pipeExec::pipeExecArgs* localArgs, PipeBase *&localFunc) {
+	   PipeBase *fresh = localArgs->procFunc->clone();
+	   bool ready;
+
+	   try {
+			 ready = fresh->init();
+	   } catch(...) {
+			 ready = false;
+	   }
+	   if ( ! ready ) {
+			 delete fresh;
+			 ++localArgs->failedRestarts;
+			 std::cout << "pipeExec::restartStage() - ERROR initializing a new instance of stage " << localArgs->position << ", keeping the old one" << std::endl;
+			 return false;
+	   }
+
+	   try {
+			 localFunc->end();
+	   } catch(...) {
+	   }
+	   if ( localFunc != localArgs->procFunc )
+			 delete localFunc;
+
+	   localFunc = fresh;
+	   ++localArgs->restarts;
+
+	   return true;
+}
+
+// Run the stage on a buffer applying its error policy. Unless the policy is
+// ERR_RETHROW, an exception or a false return is a failure of the buffer, not
+// of the instance. Returns false if the buffer has been taken out of the pipe.
+static bool runStage(pipeExec::pipeExecArgs* localArgs, PipeBase *&localFunc, void *data, bool &cont) {
+	   int attempt = 0;
+	   bool done;
+
+	   if ( localArgs->policy == pipeExec::ERR_RETHROW ) {
+			 cont = localFunc->run(data);
+			 return true;
+	   }
+
+	   for (;;) {
+			 try {
+				    done = localFunc->run(data);
+			 } catch(...) {
+				    done = false;
+			 }
+			 if ( done ) return true;
+
+			 ++localArgs->failures;
+
+			 if ( localArgs->policy == pipeExec::ERR_DEADLETTER ) break;
+
+			 // A failed restart still counts as an attempt on the old instance
+			 if ( localArgs->policy == pipeExec::ERR_RESTART )
+				    restartStage(localArgs, localFunc);
+
+			 if ( attempt++ >= localArgs->retries ) break;
+			 ++localArgs->retried;
+	   }
+
+	   // Give up on the buffer. It goes to the dead letter queue or back to the
+	   // head so it is never lost from the pool.
+	   if ( localArgs->checkpoint )
+			 localArgs->checkpoint->completed(data, localArgs->position, true, currentTag_);
+
+	   if ( localArgs->deadLetter ) {
+			 ++localArgs->deadLettered;
+			 localArgs->deadLetter->putFullBuffer(data);
+	   } else {
+			 ++localArgs->dropped;
+			 localArgs->currentHead->putFreeBuffer(data);
+	   }
+
+	   return false;
+}
+
+// Each instance clones and initializes its stage on its own thread. When the
+// pipe is started they all meet at startBarrier before taking any data.
+void execElement(pipeExec::pipeExecArgs* localArgs, int instance, std::shared_ptr<Barrier> startBarrier) {
 	   int id;
 
 	   id = localArgs->threadId;
 
 	   try {
-			 bool cont;
+			 bool cont = true;
 			 void* data;
+			 bufferTag tag;
 			 PipeBase *localFunc;
 
-			 if ( localArgs->currentInstance != 0 )
+			 if ( instance != 0 )
 				    localFunc = localArgs->procFunc->clone(); // Get a new instance
 			 else
 				    localFunc = localArgs->procFunc;
 
-			 // Needed do to a race condition with currentInstance
-			 launchMutex_.unlock();
-
 			 cont = localFunc->init();
 
-			 while ( cont ) {
-				    localArgs->mgrIn->waitForFull();
-				    data = localArgs->mgrIn->getFullBuffer();
+			 if ( startBarrier )
+				    startBarrier->arriveAndWait();
 
-				    if ( data == (void*)NULL ) break; // Terminate
+			 SimpleMemoryManager *in = localArgs->mgrIn.load();
 
-				    if ( localArgs->switching ) localArgs->stop.lock();
-				    cont = localFunc->run((void*)data);
+			 while ( cont ) {
+				    in->waitForFull();
+				    data = in->getFullBuffer(&tag);
+				    currentTag_ = tag;
+
+				    // A NULL terminates the instance, unless deleteNode has moved
+				    // mgrIn to another queue; then the instance follows it
+				    if ( data == (void*)NULL ) {
+						  if ( in == localArgs->mgrIn.load() ) break; // Terminate
+						  in = localArgs->mgrIn.load();
+						  ++localArgs->relinked;
+						  continue;
+				    }
 
-				    if ( ! localArgs->isTail )
-						  localArgs->mgrOut->putFullBuffer(data);
-				    else
-						  localArgs->mgrOut->putFreeBuffer(data);
+				    if ( localArgs->switching ) localArgs->stop.lock();
+				    if ( runStage(localArgs, localFunc, data, cont) ) {
+						  // mgrOut can be relinked by deleteNode, which waits for every
+						  // instance that may still hold the old one. The epoch is read
+						  // again once counted, so an instance that was counted in an
+						  // epoch already waited for moves to the current one.
+						  unsigned int epoch;
+						  for (;;) {
+								epoch = localArgs->epoch.load();
+								++localArgs->forwarding[epoch & 1];
+								if ( localArgs->epoch.load() == epoch ) break;
+								--localArgs->forwarding[epoch & 1];
+						  }
+						  SimpleMemoryManager *out = localArgs->mgrOut.load();
+						  bool isTail = out == localArgs->currentHead;
+
+						  if ( localArgs->checkpoint )
+								localArgs->checkpoint->completed(data, localArgs->position, isTail, tag);
+
+						  if ( ! isTail )
+								out->putFullBuffer(data, tag);
+						  else
+								out->putFreeBuffer(data);
+						  --localArgs->forwarding[epoch & 1];
+				    }
 				    if ( localArgs->switching ) localArgs->stop.unlock();
 
 				    // If switched, then init fuction has to be called again
@@ -123,44 +249,130 @@ int pipeExec::runPipe()
 {
 	   int execCount = 0;
 
-	   for ( int i0 = 0; i0 < execList.size(); ++i0) {
-			 //			 cout << "Launching " << execList[i0]->instances << " instances" << endl;
-			 for ( int i1 = 0; i1 < execList[i0]->instances; ++i1 ) {
-				    // Needed do to a race condition with currentInstance - see execElement
-				    launchMutex_.lock();
-				    execList[i0]->currentInstance = i1;
-				    try {
-						  execList[i0]->runningThreads.push_back( new std::thread(execElement, execList[i0]));
-				    } catch(...) {
-						  cout << "runPipe() - Error creating thread" << endl;
-						  throw;
-				    }
-				    execList[i0]->threadId = execCount++;
+	   if ( checkpoint_ ) checkpoint_->start();
+
+	   // Every queue serves the buffers the same way as the head, so the tag
+	   // given at the head is respected by every stage. The head mode may have
+	   // changed since addFunction; buffers already queued keep their tags.
+	   for ( int i = 0; i < execList.size(); ++i)
+			 if ( execList[i]->mgrOut != execList[0]->currentHead )
+				    execList[i]->mgrOut.load()->setQueueMode(execList[0]->currentHead->getQueueMode(), execList[0]->currentHead->getLanes());
+
+	   // All the instances start at once and run init() in parallel. Data only
+	   // flows once every one of them is ready.
+	   for ( int i0 = 0; i0 < execList.size(); ++i0)
+			 execCount += execList[i0]->instances;
+	   std::shared_ptr<Barrier> startBarrier(new Barrier(execCount + 1));
+
+	   execCount = 0;
+	   for ( int i0 = 0; i0 < execList.size(); ++i0)
+			 execCount += launchNode(i0, execCount, startBarrier);
+
+	   startBarrier->arriveAndWait();
+
+	   return execCount;
+}
+
+// Start the threads of all the instances of a stage
+int pipeExec::launchNode(int index, int firstId, std::shared_ptr<Barrier> startBarrier) {
+
+	   for ( int i1 = 0; i1 < execList[index]->instances; ++i1 ) {
+			 try {
+				    execList[index]->runningThreads.push_back( new std::thread(execElement, execList[index], i1, startBarrier));
+			 } catch(...) {
+				    cout << "runPipe() - Error creating thread" << endl;
+				    throw;
 			 }
+			 execList[index]->threadId = firstId + i1;
 	   }
 
-	   return execCount;
+	   return execList[index]->instances;
 }
 
-// Can not destroy de node because there are other threads waiting on the pipe
-// We just destroy all the threads and add a null function to allow for the
-// data to pass thru
+// The upstream stage is relinked to write straight into the queue after the
+// deleted one. The new mgrOut is published first and then the epoch flipped;
+// once every instance that started forwarding in the old epoch is done, no
+// buffer can enter the deleted stage queue any more. The NULLs sent by
+// killNode are only handed out once that queue is empty, so the buffers
+// still in flight are all processed before its threads end and its queue
+// can be freed.
+//
+// The first stage has no upstream, so the next one is moved to read from the
+// head instead. Its instances keep running: each one gets a NULL after the
+// buffers left in its old queue and takes it as the cue to follow mgrIn.
 void pipeExec::deleteNode(int index) {
+	   pipeExecArgs *element = execList[index];
+	   bool running = ! element->runningThreads.empty();
+	   std::vector< std::atomic<int>* > positions;
+
+	   // Nothing to link to, just let the data pass thru
+	   if ( execList.size() == 1 ) {
+			 if ( running ) killNode(index);
+			 element->procFunc = new nullFunc();
+			 element->instances = 1;
+			 element->deleted = true;
+			 if ( running ) launchNode(index, 0);
+			 return;
+	   }
+
+	   if ( index == 0 ) {
+			 pipeExecArgs *next = execList[1];
+			 SimpleMemoryManager *queue = next->mgrIn.load();
+
+			 if ( running ) killNode(0);
+
+			 next->relinked = 0;
+			 next->mgrIn = element->mgrIn.load();
+			 if ( ! next->runningThreads.empty() ) {
+				    for (int i = 0; i < next->instances; ++i)
+						  queue->putFullBuffer((void*)NULL);
+				    while ( next->relinked.load() != next->instances )
+						  std::this_thread::yield();
+			 }
 
-	   killNode(index);
+			 delete queue;
+	   } else {
+			 pipeExecArgs *upstream = execList[index - 1];
+			 unsigned int epoch = upstream->epoch.load();
 
-	   execList[index]->procFunc = new nullFunc();
-	   execList[index]->instances = 1;
-	   execList[index]->deleted = true;
-	   execList[index]->runningThreads.push_back(new std::thread(execElement, execList[index]));
+			 upstream->mgrOut = element->mgrOut.load();
+			 upstream->isTail = element->isTail;
+			 upstream->epoch = epoch + 1;
+			 while ( upstream->forwarding[epoch & 1].load() != 0 )
+				    std::this_thread::yield();
+
+			 if ( running ) killNode(index);
+
+			 delete element->mgrIn.load();
+	   }
+
+	   execList.erase(execList.begin() + index);
+	   --count;
+
+	   // The later stages move down one position. The checkpoint moves the
+	   // buffers they completed with them, so a replay queues them in place.
+	   for ( int i = index; i < execList.size(); ++i)
+			 positions.push_back(&execList[i]->position);
+	   if ( checkpoint_ )
+			 checkpoint_->removeStage(index, positions);
+	   else
+			 for ( int i = 0; i < positions.size(); ++i)
+				    --*positions[i];
+
+	   delete element;
 }
 
 int pipeExec::killNode(int index) {
 
+	   // Not running, or already killed. killPipe, the destructor and deleteNode
+	   // can all get here for the same stage, and joining twice would throw.
+	   if ( execList[index]->runningThreads.empty() )
+			 return 0;
+
 	   //	   cout << "KILLING "  << execList[index]->instances << " INSTANCES" << endl;
 	   for (int i = 0; i < execList[index]->instances; ++i) {
 			 //			 cout << "KILLING instance "  << i  << endl;
-			 execList[index]->mgrIn->putFullBuffer((void*)NULL);
+			 execList[index]->mgrIn.load()->putFullBuffer((void*)NULL);
 	   }
 	   for (int i = 0; i < execList[index]->instances; ++i) {
 			 //			 cout << "WAITING for instance "  << i  << endl;
@@ -180,9 +392,80 @@ int pipeExec::killPipe()
 			 killCount += killNode(i);
 	   }
 
+	   if ( checkpoint_ ) checkpoint_->stop();
+
 	   return killCount;
 }
 
+void pipeExec::setCheckpoint(pipeCheckpoint *checkpoint) {
+
+	   checkpoint_ = checkpoint;
+	   if ( checkpoint ) checkpoint->reserve(execList[0]->currentHead->getBufferCount());
+	   for ( int i = 0; i < execList.size(); ++i)
+			 execList[i]->checkpoint = checkpoint;
+}
+
+int pipeExec::replayCheckpoint(pipeCheckpoint *checkpoint) {
+	   std::vector<checkpointRecord> records;
+	   SimpleMemoryManager *head = execList[0]->currentHead;
+	   void *data;
+	   int replayed = 0;
+
+	   checkpoint->load(records);
+
+	   for ( int i = 0; i < records.size(); ++i) {
+			 // Buffers completed by the tail are back in the head already
+			 if ( records[i].stage < 0 || records[i].stage >= execList.size() - 1 )
+				    continue;
+
+			 head->waitForFree();
+			 data = head->getFreeBuffer();
+			 memcpy(data, records[i].payload.data(), records[i].payload.size());
+
+			 // Record it so the next snapshot keeps it even if no stage touches it before
+			 if ( checkpoint_ )
+				    checkpoint_->completed(data, records[i].stage, false, records[i].tag);
+
+			 execList[records[i].stage]->mgrOut.load()->putFullBuffer(data, records[i].tag);
+			 ++replayed;
+	   }
+
+	   return replayed;
+}
+
+// Set how the stage running funcToSearch handles a buffer that fails
+int pipeExec::setErrorPolicy(PipeBase *funcToSearch, errorPolicy policy, int retries, SimpleMemoryManager *deadLetter) {
+	   int index;
+
+	   if ( (index = findFunction(funcToSearch)) == -1 )
+			 return -1;
+
+	   execList[index]->policy = policy;
+	   execList[index]->retries = retries;
+	   execList[index]->deadLetter = deadLetter;
+
+	   return index;
+}
+
+pipeExec::errorStats pipeExec::getErrorStats(int position) {
+	   errorStats stats;
+
+	   stats.failures = execList[position]->failures;
+	   stats.retried = execList[position]->retried;
+	   stats.restarts = execList[position]->restarts;
+	   stats.failedRestarts = execList[position]->failedRestarts;
+	   stats.deadLettered = execList[position]->deadLettered;
+	   stats.dropped = execList[position]->dropped;
+
+	   return stats;
+}
+
+// Queue statistics of a lane at the input of the stage at position
+laneStats pipeExec::getLaneStats(int position, int lane) {
+
+	   return execList[position]->mgrIn.load()->getLaneStats(lane);
+}
+
 // Returns the location index of the function funcToSearch. They are unique unless cloned
 int pipeExec::findFunction(PipeBase *funcToSearch) {
 	   for (int i = 0; i < execList.size(); ++i )
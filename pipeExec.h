@@ -5,6 +5,8 @@
 
 #include <vector>
 #include <thread>
+#include <atomic>
+#include <memory>
 #include "SimpleMemoryManager.h"
 
 #include <iostream>
@@ -12,6 +14,7 @@
 using namespace std;
 
 class PipeBase;		// Forward declaration
+class pipeCheckpoint;
 
 class pipeExec {
 
@@ -35,7 +38,8 @@ class pipeExec {
 			 // Sends NULL data to the pipe to terminate the thread
 			 int killNode(int index);
 
-			 // Leaves a push data only node
+			 // Removes the stage and links its neighbours directly. The buffers
+			 // already queued for it are still processed before it goes away.
 			 void deleteNode(int index);
 
 			 // Deletes function funcToSearch or function at position
@@ -47,33 +51,91 @@ class pipeExec {
 			 // Collapse a function with multiple instances
 			 void collapseFunc(PipeBase *funcToCollapse);
 
+			 // Starts every instance and returns once all their init() are done
 			 int runPipe();
 			 int killPipe();
 
+			 // What a stage does when run() throws or returns false
+			 //	ERR_RETHROW	Rethrow the exception (default). A false return ends the instance.
+			 //	ERR_RETRY	Run the buffer again, up to retries times
+			 //	ERR_RESTART	Replace the instance with a fresh clone, then retry. The
+			 //			clone is initialized before end() is called on the old one,
+			 //			if its init() fails the old instance is kept.
+			 //	ERR_DEADLETTER	Do not retry, retries is ignored
+			 // A buffer that still fails is queued in deadLetter as a full buffer, or
+			 // returned to the head if there is no dead letter queue. deadLetter must
+			 // hold as many buffers as the head and is drained by the caller.
+			 enum errorPolicy { ERR_RETHROW, ERR_RETRY, ERR_RESTART, ERR_DEADLETTER };
+
+			 typedef struct {
+				    int failures;	// Failed runs
+				    int retried;	// Runs repeated
+				    int restarts;	// Instances replaced
+				    int failedRestarts;	// Clones that failed init(), the old instance was kept
+				    int deadLettered;	// Buffers sent to the dead letter queue
+				    int dropped;	// Buffers returned to the head
+			 } errorStats;
+
+			 // Must be set before runPipe, the instances read the policy unlocked.
+			 // Returns the position of the stage or -1 if funcToSearch is not found
+			 int setErrorPolicy(PipeBase *funcToSearch, errorPolicy policy, int retries = 0, SimpleMemoryManager *deadLetter = NULL);
+
+			 errorStats getErrorStats(int position);
+
+			 // Lanes are set on the head with setQueueMode before runPipe and the
+			 // buffers tagged when queued with putFullBuffer(buffer, tag)
+			 laneStats getLaneStats(int position, int lane);
+
+			 // Tag of the buffer the calling stage instance is running
+			 static bufferTag getCurrentTag();
+
+			 // Save the stage and payload of the buffers in flight to the checkpoint
+			 // log. Buffers still waiting in the head are not saved, the source is
+			 // expected to send them again. Must be set before runPipe.
+			 void setCheckpoint(pipeCheckpoint *checkpoint);
+
+			 // Take buffers from the head and queue them after the stage that had
+			 // completed them when the last snapshot was taken. Must be called before
+			 // runPipe. Returns the number of buffers re-injected.
+			 int replayCheckpoint(pipeCheckpoint *checkpoint);
+
 
 			 typedef struct  {
 				    PipeBase		*procFunc;
 				    SimpleMemoryManager*	currentHead; // Needed to implemnt splice
-				    SimpleMemoryManager*	mgrIn;
-				    SimpleMemoryManager*	mgrOut;
+				    std::atomic<SimpleMemoryManager*>	mgrIn;  // Relinked while running by deleteNode
+				    std::atomic<SimpleMemoryManager*>	mgrOut; // Relinked while running by deleteNode
 				    int			instances;
-				    int			currentInstance;
 				    bool			isTail; // Needed to implement splice
 				    int			threadId;
 				    bool			switching;
 				    bool deleted;
+				    std::atomic<int>	position;
+				    std::atomic<unsigned int>	epoch;		// Read side of the mgrOut handover
+				    std::atomic<int>	forwarding[2];	// Instances forwarding a buffer, per epoch parity
+				    std::atomic<int>	relinked;	// Instances that followed mgrIn to a new queue
+				    pipeCheckpoint	*checkpoint;
+				    errorPolicy		policy;
+				    int			retries;
+				    SimpleMemoryManager*	deadLetter;
+				    std::atomic<int>	failures, retried, restarts, failedRestarts, deadLettered, dropped;
 				    std::mutex	stop;
 				    std::vector< std::thread* >	runningThreads;
 			 } pipeExecArgs;
 
 	   private:
 
+			 int launchNode(int index, int firstId, std::shared_ptr<Barrier> startBarrier = std::shared_ptr<Barrier>());
+
 			 int count;
+			 pipeCheckpoint *checkpoint_;
 			 std::vector< pipeExecArgs* >	execList;
 };
 
 class PipeBase {
 	   public:
+			 virtual ~PipeBase() {}
+
 			 virtual bool init() { return true; }
 			 virtual bool run(void* args) { return true; } // Should return a void * so it can change data structure ?
 			 virtual void end() { return; }
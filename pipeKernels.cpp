@@ -0,0 +1,342 @@
+#include "pipeKernels.h"
+#include <immintrin.h>
+#include <string.h>
+
+// Kernel table for one instruction set
+typedef struct {
+	void (*scale)(float *, size_t, float);
+	void (*offset)(float *, size_t, float);
+	void (*clamp)(float *, size_t, float, float);
+	uint64_t (*checksum)(const uint32_t *, size_t);
+	kernelIsa isa;
+} kernelTable;
+
+// Scalar kernels. They are also used for the elements left over by the vector ones.
+
+static void scaleScalar(float *data, size_t count, float factor) {
+	for (size_t i = 0; i < count; ++i)
+		data[i] *= factor;
+}
+
+static void offsetScalar(float *data, size_t count, float value) {
+	for (size_t i = 0; i < count; ++i)
+		data[i] += value;
+}
+
+// A NaN fails both compares and is left as is. The vector versions give the
+// same result because min/max return their second operand when one is a NaN.
+static void clampScalar(float *data, size_t count, float low, float high) {
+	for (size_t i = 0; i < count; ++i) {
+		if ( data[i] < low ) data[i] = low;
+		if ( data[i] > high ) data[i] = high;
+	}
+}
+
+static uint64_t checksumScalar(const uint32_t *data, size_t count) {
+	uint64_t sum = 0;
+
+	for (size_t i = 0; i < count; ++i)
+		sum += data[i];
+
+	return sum;
+}
+
+// AVX2 kernels
+
+__attribute__((target("avx2")))
+static void scaleAvx2(float *data, size_t count, float factor) {
+	__m256 k = _mm256_set1_ps(factor);
+	size_t i = 0;
+
+	for ( ; i + 8 <= count; i += 8)
+		_mm256_storeu_ps(data + i, _mm256_mul_ps(_mm256_loadu_ps(data + i), k));
+
+	scaleScalar(data + i, count - i, factor);
+}
+
+__attribute__((target("avx2")))
+static void offsetAvx2(float *data, size_t count, float value) {
+	__m256 k = _mm256_set1_ps(value);
+	size_t i = 0;
+
+	for ( ; i + 8 <= count; i += 8)
+		_mm256_storeu_ps(data + i, _mm256_add_ps(_mm256_loadu_ps(data + i), k));
+
+	offsetScalar(data + i, count - i, value);
+}
+
+__attribute__((target("avx2")))
+static void clampAvx2(float *data, size_t count, float low, float high) {
+	__m256 lo = _mm256_set1_ps(low);
+	__m256 hi = _mm256_set1_ps(high);
+	size_t i = 0;
+
+	for ( ; i + 8 <= count; i += 8)
+		_mm256_storeu_ps(data + i, _mm256_min_ps(hi, _mm256_max_ps(lo, _mm256_loadu_ps(data + i))));
+
+	clampScalar(data + i, count - i, low, high);
+}
+
+__attribute__((target("avx2")))
+static uint64_t checksumAvx2(const uint32_t *data, size_t count) {
+	__m256i sum0 = _mm256_setzero_si256();
+	__m256i sum1 = _mm256_setzero_si256();
+	uint64_t lanes[4];
+	size_t i = 0;
+
+	// Widen each group of 8 words to 64 bits so the sums can not overflow
+	for ( ; i + 8 <= count; i += 8) {
+		__m256i words = _mm256_loadu_si256((const __m256i *)(data + i));
+		sum0 = _mm256_add_epi64(sum0, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(words)));
+		sum1 = _mm256_add_epi64(sum1, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(words, 1)));
+	}
+
+	_mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(sum0, sum1));
+
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + checksumScalar(data + i, count - i);
+}
+
+// AVX-512 kernels. The tail is handled with masked loads and stores.
+
+__attribute__((target("avx512f")))
+static void scaleAvx512(float *data, size_t count, float factor) {
+	__m512 k = _mm512_set1_ps(factor);
+	size_t i = 0;
+
+	for ( ; i + 16 <= count; i += 16)
+		_mm512_storeu_ps(data + i, _mm512_mul_ps(_mm512_loadu_ps(data + i), k));
+
+	if ( i < count ) {
+		__mmask16 mask = (__mmask16)((1u << (count - i)) - 1);
+		_mm512_mask_storeu_ps(data + i, mask, _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, data + i), k));
+	}
+}
+
+__attribute__((target("avx512f")))
+static void offsetAvx512(float *data, size_t count, float value) {
+	__m512 k = _mm512_set1_ps(value);
+	size_t i = 0;
+
+	for ( ; i + 16 <= count; i += 16)
+		_mm512_storeu_ps(data + i, _mm512_add_ps(_mm512_loadu_ps(data + i), k));
+
+	if ( i < count ) {
+		__mmask16 mask = (__mmask16)((1u << (count - i)) - 1);
+		_mm512_mask_storeu_ps(data + i, mask, _mm512_add_ps(_mm512_maskz_loadu_ps(mask, data + i), k));
+	}
+}
+
+__attribute__((target("avx512f")))
+static void clampAvx512(float *data, size_t count, float low, float high) {
+	__m512 lo = _mm512_set1_ps(low);
+	__m512 hi = _mm512_set1_ps(high);
+	size_t i = 0;
+
+	for ( ; i + 16 <= count; i += 16)
+		_mm512_storeu_ps(data + i, _mm512_min_ps(hi, _mm512_max_ps(lo, _mm512_loadu_ps(data + i))));
+
+	if ( i < count ) {
+		__mmask16 mask = (__mmask16)((1u << (count - i)) - 1);
+		_mm512_mask_storeu_ps(data + i, mask, _mm512_min_ps(hi, _mm512_max_ps(lo, _mm512_maskz_loadu_ps(mask, data + i))));
+	}
+}
+
+__attribute__((target("avx512f")))
+static uint64_t checksumAvx512(const uint32_t *data, size_t count) {
+	__m512i sum0 = _mm512_setzero_si512();
+	__m512i sum1 = _mm512_setzero_si512();
+	size_t i = 0;
+
+	for ( ; i + 16 <= count; i += 16) {
+		__m512i words = _mm512_loadu_si512((const void *)(data + i));
+		sum0 = _mm512_add_epi64(sum0, _mm512_cvtepu32_epi64(_mm512_castsi512_si256(words)));
+		sum1 = _mm512_add_epi64(sum1, _mm512_cvtepu32_epi64(_mm512_extracti64x4_epi64(words, 1)));
+	}
+
+	return (uint64_t)_mm512_reduce_add_epi64(_mm512_add_epi64(sum0, sum1)) + checksumScalar(data + i, count - i);
+}
+
+static const kernelTable scalarKernels = { scaleScalar, offsetScalar, clampScalar, checksumScalar, ISA_SCALAR };
+static const kernelTable avx2Kernels = { scaleAvx2, offsetAvx2, clampAvx2, checksumAvx2, ISA_AVX2 };
+static const kernelTable avx512Kernels = { scaleAvx512, offsetAvx512, clampAvx512, checksumAvx512, ISA_AVX512 };
+
+static kernelIsa supportedIsa() {
+	__builtin_cpu_init();
+	if ( __builtin_cpu_supports("avx512f") )
+		return ISA_AVX512;
+	if ( __builtin_cpu_supports("avx2") )
+		return ISA_AVX2;
+	return ISA_SCALAR;
+}
+
+static const kernelTable *tableFor(kernelIsa isa) {
+	switch ( isa ) {
+		case ISA_AVX512: return &avx512Kernels;
+		case ISA_AVX2: return &avx2Kernels;
+		default: return &scalarKernels;
+	}
+}
+
+static std::atomic<const kernelTable *> activeKernels(NULL);
+
+static inline const kernelTable *kernels() {
+	const kernelTable *table = activeKernels.load(std::memory_order_relaxed);
+
+	if ( table == NULL ) {
+		table = tableFor(supportedIsa());
+		activeKernels.store(table, std::memory_order_relaxed);
+	}
+
+	return table;
+}
+
+kernelIsa getKernelIsa() {
+
+	return kernels()->isa;
+}
+
+kernelIsa setKernelIsa(kernelIsa isa) {
+	kernelIsa best = supportedIsa();
+
+	if ( isa > best ) isa = best;
+	activeKernels.store(tableFor(isa));
+
+	return isa;
+}
+
+const char *getKernelIsaName(kernelIsa isa) {
+	switch ( isa ) {
+		case ISA_AVX512: return "avx512";
+		case ISA_AVX2: return "avx2";
+		default: return "scalar";
+	}
+}
+
+void kernelScale(float *data, size_t count, float factor) {
+	kernels()->scale(data, count, factor);
+}
+
+void kernelOffset(float *data, size_t count, float value) {
+	kernels()->offset(data, count, value);
+}
+
+void kernelClamp(float *data, size_t count, float low, float high) {
+	kernels()->clamp(data, count, low, high);
+}
+
+uint64_t kernelChecksum(const uint32_t *data, size_t count) {
+	return kernels()->checksum(data, count);
+}
+
+// Byte histograms do not map well to gathers/scatters, so there is only a
+// scalar version. Four partial tables break the dependency on repeated bytes.
+void kernelHistogram(const uint8_t *data, size_t count, uint64_t *bins) {
+	uint32_t partial[4][256];
+	size_t i = 0;
+
+	memset(partial, 0, sizeof(partial));
+
+	for ( ; i + 4 <= count; i += 4) {
+		++partial[0][data[i]];
+		++partial[1][data[i + 1]];
+		++partial[2][data[i + 2]];
+		++partial[3][data[i + 3]];
+	}
+	for ( ; i < count; ++i)
+		++partial[0][data[i]];
+
+	for (int bin = 0; bin < 256; ++bin)
+		bins[bin] += (uint64_t)partial[0][bin] + partial[1][bin] + partial[2][bin] + partial[3][bin];
+}
+
+// Stages
+
+bool scaleStage::run(void *data) {
+	bufferView<float> view(data, count_, offset_);
+
+	kernelScale(view.data(), view.size(), factor_);
+
+	return true;
+}
+
+scaleStage * scaleStage::clone() const { return new scaleStage(factor_, count_, offset_); }
+
+bool offsetStage::run(void *data) {
+	bufferView<float> view(data, count_, offset_);
+
+	kernelOffset(view.data(), view.size(), value_);
+
+	return true;
+}
+
+offsetStage * offsetStage::clone() const { return new offsetStage(value_, count_, offset_); }
+
+bool clampStage::run(void *data) {
+	bufferView<float> view(data, count_, offset_);
+
+	kernelClamp(view.data(), view.size(), low_, high_);
+
+	return true;
+}
+
+clampStage * clampStage::clone() const { return new clampStage(low_, high_, count_, offset_); }
+
+checksumStage::checksumStage(size_t count, size_t offset)
+: count_(count), offset_(offset), owner_(true), total_(new std::atomic<uint64_t>(0)) {}
+
+// Clones share the running total of the original stage
+checksumStage::checksumStage(const checksumStage *parent)
+: count_(parent->count_), offset_(parent->offset_), owner_(false), total_(parent->total_) {}
+
+checksumStage::~checksumStage() {
+	if ( owner_ ) delete total_;
+}
+
+bool checksumStage::run(void *data) {
+	bufferView<uint32_t> view(data, count_, offset_);
+
+	total_->fetch_add(kernelChecksum(view.data(), view.size()), std::memory_order_relaxed);
+
+	return true;
+}
+
+checksumStage * checksumStage::clone() const { return new checksumStage(this); }
+
+histogramStage::histogramStage(size_t count, size_t offset)
+: count_(count), offset_(offset), owner_(true), bins_(new std::atomic<uint64_t>[256]) {
+	reset();
+}
+
+// Clones share the bins of the original stage
+histogramStage::histogramStage(const histogramStage *parent)
+: count_(parent->count_), offset_(parent->offset_), owner_(false), bins_(parent->bins_) {}
+
+histogramStage::~histogramStage() {
+	if ( owner_ ) delete [] bins_;
+}
+
+bool histogramStage::run(void *data) {
+	bufferView<uint8_t> view(data, count_, offset_);
+	uint64_t local[256];
+
+	// Count locally and publish only the bins that changed
+	memset(local, 0, sizeof(local));
+	kernelHistogram(view.data(), view.size(), local);
+	for (int bin = 0; bin < 256; ++bin)
+		if ( local[bin] )
+			bins_[bin].fetch_add(local[bin], std::memory_order_relaxed);
+
+	return true;
+}
+
+histogramStage * histogramStage::clone() const { return new histogramStage(this); }
+
+void histogramStage::getHistogram(uint64_t *bins) {
+	for (int bin = 0; bin < 256; ++bin)
+		bins[bin] = bins_[bin].load();
+}
+
+void histogramStage::reset() {
+	for (int bin = 0; bin < 256; ++bin)
+		bins_[bin].store(0);
+}
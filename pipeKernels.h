@@ -0,0 +1,162 @@
+// pipeKernels.h
+
+#ifndef _pipeKernels_h_
+#define _pipeKernels_h_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include "pipeExec.h"
+
+// Typed view of the numeric payload carried by a pipe buffer. The elements
+// start "offset" bytes into the buffer and there are "count" of them.
+template <typename T>
+class bufferView {
+
+	   public:
+
+			 bufferView(void *buffer, size_t count, size_t offset = 0)
+			 : data_((T *)((char *)buffer + offset)), count_(count) {}
+
+			 T *data() { return data_; }
+			 size_t size() { return count_; }
+			 T &operator[](size_t index) { return data_[index]; }
+
+			 // Bytes from the start of the buffer to the end of the view
+			 static size_t extent(size_t count, size_t offset = 0) { return offset + count * sizeof(T); }
+
+	   private:
+
+			 T *data_;
+			 size_t count_;
+};
+
+// Instruction sets the kernels can run with. The best one supported by the
+// CPU is selected the first time a kernel is called.
+enum kernelIsa { ISA_SCALAR, ISA_AVX2, ISA_AVX512 };
+
+kernelIsa getKernelIsa();			// ISA currently in use
+kernelIsa setKernelIsa(kernelIsa isa);		// Force an ISA, clamped to what the CPU supports
+const char *getKernelIsaName(kernelIsa isa);
+
+// Raw kernels, dispatched to the selected ISA
+void kernelScale(float *data, size_t count, float factor);
+void kernelOffset(float *data, size_t count, float value);
+void kernelClamp(float *data, size_t count, float low, float high);
+uint64_t kernelChecksum(const uint32_t *data, size_t count);	// Sum of the 32 bit words
+void kernelHistogram(const uint8_t *data, size_t count, uint64_t *bins);	// 256 bins
+
+// The stages work on count elements starting offset bytes into the buffer.
+// getExtent() is the number of bytes that must be there, it should not be
+// more than the getBufferSize() of the pool feeding the stage.
+
+// data[i] = data[i] * factor
+class scaleStage : public PipeBase {
+
+	   public:
+
+			 scaleStage(float factor, size_t count, size_t offset = 0)
+			 : factor_(factor), count_(count), offset_(offset) {}
+
+			 bool run(void *data);
+			 scaleStage * clone() const;
+
+			 size_t getExtent() const { return bufferView<float>::extent(count_, offset_); }
+
+	   private:
+
+			 float factor_;
+			 size_t count_, offset_;
+};
+
+// data[i] = data[i] + value
+class offsetStage : public PipeBase {
+
+	   public:
+
+			 offsetStage(float value, size_t count, size_t offset = 0)
+			 : value_(value), count_(count), offset_(offset) {}
+
+			 bool run(void *data);
+			 offsetStage * clone() const;
+
+			 size_t getExtent() const { return bufferView<float>::extent(count_, offset_); }
+
+	   private:
+
+			 float value_;
+			 size_t count_, offset_;
+};
+
+// data[i] = min(max(data[i], low), high). NaNs are left as they are.
+class clampStage : public PipeBase {
+
+	   public:
+
+			 clampStage(float low, float high, size_t count, size_t offset = 0)
+			 : low_(low), high_(high), count_(count), offset_(offset) {}
+
+			 bool run(void *data);
+			 clampStage * clone() const;
+
+			 size_t getExtent() const { return bufferView<float>::extent(count_, offset_); }
+
+	   private:
+
+			 float low_, high_;
+			 size_t count_, offset_;
+};
+
+// Adds the 32 bit words of every buffer to a running total. The total is
+// shared by all the instances of the stage, so it is the same whatever the
+// number of instances or the order the buffers arrive in.
+class checksumStage : public PipeBase {
+
+	   public:
+
+			 checksumStage(size_t count, size_t offset = 0);
+			 ~checksumStage();
+
+			 bool run(void *data);
+			 checksumStage * clone() const;
+
+			 size_t getExtent() const { return bufferView<uint32_t>::extent(count_, offset_); }
+
+			 uint64_t getChecksum() { return total_->load(); }
+			 void reset() { total_->store(0); }
+
+	   private:
+
+			 checksumStage(const checksumStage *parent);
+
+			 size_t count_, offset_;
+			 bool owner_;
+			 std::atomic<uint64_t> *total_;
+};
+
+// Byte histogram of the payload, shared by all the instances of the stage
+class histogramStage : public PipeBase {
+
+	   public:
+
+			 histogramStage(size_t count, size_t offset = 0);
+			 ~histogramStage();
+
+			 bool run(void *data);
+			 histogramStage * clone() const;
+
+			 size_t getExtent() const { return bufferView<uint8_t>::extent(count_, offset_); }
+
+			 void getHistogram(uint64_t *bins);	// Copies the 256 bins
+			 void reset();
+
+	   private:
+
+			 histogramStage(const histogramStage *parent);
+
+			 size_t count_, offset_;
+			 bool owner_;
+			 std::atomic<uint64_t> *bins_;
+};
+
+#endif
@@ -0,0 +1,479 @@
+#include "pipeTransport.h"
+#include <string>
+#include <climits>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define TRANSPORT_MAGIC		0x50495045	// "PIPE"
+
+enum { FRAME_DATA = 1, FRAME_END = 2 };
+
+// Frame header, followed by size bytes of payload
+typedef struct {
+	uint32_t magic;
+	uint32_t type;
+	uint32_t size;
+	int32_t lane;
+	int64_t budget;		// Nanoseconds left to the deadline, clocks are not shared
+} frameHeader;
+
+// Sent by the receiver for every batch of free buffers it reserves
+typedef struct {
+	uint32_t magic;
+	uint32_t credits;
+} creditMessage;
+
+static bool readAll(int fd, void *buffer, size_t size) {
+	char *data = (char *)buffer;
+	ssize_t got;
+
+	while ( size ) {
+		if ( (got = recv(fd, data, size, MSG_WAITALL)) <= 0 ) {
+			if ( got < 0 && errno == EINTR ) continue;
+			return false;
+		}
+		data += got;
+		size -= got;
+	}
+
+	return true;
+}
+
+// sendmsg may write only part of the iovecs, so keep going from where it stopped
+static bool sendAll(int fd, struct iovec *iov, int count, int flags) {
+	struct msghdr msg;
+	ssize_t sent;
+
+	while ( count ) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+
+		if ( (sent = sendmsg(fd, &msg, flags | MSG_NOSIGNAL)) < 0 ) {
+			if ( errno == EINTR ) continue;
+			return false;
+		}
+		while ( count && (size_t)sent >= iov->iov_len ) {
+			sent -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if ( count ) {
+			iov->iov_base = (char *)iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+
+	return true;
+}
+
+// Setting TCP_NODELAY pushes out anything held back by MSG_MORE. It fails
+// harmlessly on Unix sockets, which do not hold data back.
+static void flushSocket(int fd) {
+	int one = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+// Fills addr from "tcp:host:port" or "unix:/path"
+static int parseAddress(const char *address, struct sockaddr_storage *addr, socklen_t *len) {
+	std::string spec(address);
+
+	memset(addr, 0, sizeof(*addr));
+
+	if ( spec.compare(0, 5, "unix:") == 0 ) {
+		struct sockaddr_un *un = (struct sockaddr_un *)addr;
+		std::string path = spec.substr(5);
+
+		if ( path.size() >= sizeof(un->sun_path) )
+			return -1;
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, path.c_str());
+		*len = sizeof(*un);
+		return AF_UNIX;
+	}
+
+	if ( spec.compare(0, 4, "tcp:") == 0 ) {
+		size_t colon = spec.rfind(':');
+		std::string host = spec.substr(4, colon - 4);
+		std::string port = spec.substr(colon + 1);
+		struct addrinfo hints, *result;
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if ( getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &result) != 0 )
+			return -1;
+		memcpy(addr, result->ai_addr, result->ai_addrlen);
+		*len = result->ai_addrlen;
+		freeaddrinfo(result);
+		return AF_INET;
+	}
+
+	return -1;
+}
+
+static void setNoDelay(int fd, int family) {
+	int one = 1;
+
+	if ( family == AF_INET )
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int transportListen(const char *address, int *port) {
+	struct sockaddr_storage addr;
+	socklen_t len;
+	int family, listener, one = 1;
+
+	if ( (family = parseAddress(address, &addr, &len)) == -1 ) {
+		std::cout << "transportListen() - ERROR bad address " << address << std::endl;
+		return -1;
+	}
+
+	if ( family == AF_UNIX )
+		unlink(((struct sockaddr_un *)&addr)->sun_path);
+
+	if ( (listener = socket(family, SOCK_STREAM, 0)) == -1 )
+		return -1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if ( bind(listener, (struct sockaddr *)&addr, len) == -1 || listen(listener, 1) == -1 ) {
+		std::cout << "transportListen() - ERROR listening on " << address << std::endl;
+		close(listener);
+		return -1;
+	}
+
+	// With port 0 the system picks a free one
+	if ( port != NULL ) {
+		*port = 0;
+		len = sizeof(addr);
+		if ( family == AF_INET && getsockname(listener, (struct sockaddr *)&addr, &len) == 0 )
+			*port = ntohs(((struct sockaddr_in *)&addr)->sin_port);
+	}
+
+	return listener;
+}
+
+int transportAccept(int listener) {
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(addr);
+	int fd;
+
+	while ( (fd = accept(listener, NULL, NULL)) == -1 && errno == EINTR )
+		;
+
+	if ( fd != -1 && getsockname(fd, (struct sockaddr *)&addr, &len) == 0 )
+		setNoDelay(fd, addr.ss_family);
+
+	close(listener);
+
+	return fd;
+}
+
+int transportAccept(const char *address) {
+	struct sockaddr_storage addr;
+	socklen_t len;
+	int listener, fd;
+
+	if ( (listener = transportListen(address)) == -1 )
+		return -1;
+
+	fd = transportAccept(listener);
+
+	if ( parseAddress(address, &addr, &len) == AF_UNIX )
+		unlink(((struct sockaddr_un *)&addr)->sun_path);
+
+	return fd;
+}
+
+int transportConnect(const char *address, int timeoutMs) {
+	struct sockaddr_storage addr;
+	socklen_t len;
+	int family, fd;
+
+	if ( (family = parseAddress(address, &addr, &len)) == -1 ) {
+		std::cout << "transportConnect() - ERROR bad address " << address << std::endl;
+		return -1;
+	}
+
+	// The peer may not be listening yet
+	for ( int waited = 0; ; waited += 10 ) {
+		if ( (fd = socket(family, SOCK_STREAM, 0)) == -1 )
+			return -1;
+		if ( connect(fd, (struct sockaddr *)&addr, len) == 0 )
+			break;
+		close(fd);
+		if ( waited >= timeoutMs ) {
+			std::cout << "transportConnect() - ERROR connecting to " << address << std::endl;
+			return -1;
+		}
+		usleep(10000);
+	}
+
+	setNoDelay(fd, family);
+
+	return fd;
+}
+
+// Sender
+
+transportSender::transportSender(int fd, size_t payloadSize, int batch, unsigned int lingerUs)
+: state_(new transportState()), owner_(true), lingerUs_(lingerUs) {
+
+	state_->fd = fd;
+	state_->payloadSize = payloadSize;
+	state_->batch = batch < 1 ? 1 : batch;
+	state_->credits = 0;
+	state_->unflushed = 0;
+	state_->active = 0;
+	state_->failed = false;
+	state_->frames = 0;
+	state_->dropped = 0;
+	state_->flushStop = false;
+	state_->flusher = NULL;
+
+	if ( state_->batch > 1 )
+		state_->flusher = new std::thread(&transportSender::flusherThread, this);
+}
+
+// Clones share the socket, the credits and the flusher of the original stage
+transportSender::transportSender(const transportSender *parent)
+: state_(parent->state_), owner_(false), lingerUs_(parent->lingerUs_) {}
+
+transportSender::~transportSender() {
+
+	if ( ! owner_ )
+		return;
+
+	if ( state_->flusher ) {
+		state_->sendMutex.lock();
+		state_->flushStop = true;
+		state_->sendMutex.unlock();
+		state_->flushWake.notify_one();
+		state_->flusher->join();
+		delete state_->flusher;
+	}
+
+	delete state_;
+}
+
+transportSender * transportSender::clone() const { return new transportSender(this); }
+
+// Pushes out corked frames that have been waiting for lingerUs
+void transportSender::flusherThread() {
+	std::unique_lock<std::mutex> lock(state_->sendMutex);
+
+	while ( ! state_->flushStop ) {
+		if ( state_->unflushed == 0 ) {
+			state_->flushWake.wait(lock);
+			continue;
+		}
+
+		unsigned long long seen = state_->frames;
+		state_->flushWake.wait_for(lock, std::chrono::microseconds(lingerUs_));
+		if ( state_->unflushed && state_->frames == seen ) {
+			flushSocket(state_->fd);
+			state_->unflushed = 0;
+		}
+	}
+}
+
+bool transportSender::init() {
+
+	state_->sendMutex.lock();
+	++state_->active;
+	state_->sendMutex.unlock();
+
+	return true;
+}
+
+bool transportSender::waitForCredit() {
+	std::lock_guard<std::mutex> lock(state_->creditMutex);
+	creditMessage message;
+
+	while ( state_->credits == 0 ) {
+		// The receiver may be waiting for corked frames before it frees buffers
+		state_->sendMutex.lock();
+		if ( state_->unflushed ) {
+			flushSocket(state_->fd);
+			state_->unflushed = 0;
+		}
+		state_->sendMutex.unlock();
+
+		if ( state_->failed || ! readAll(state_->fd, &message, sizeof(message)) || message.magic != TRANSPORT_MAGIC ) {
+			state_->failed = true;
+			return false;
+		}
+		state_->credits += message.credits;
+	}
+	--state_->credits;
+
+	return true;
+}
+
+bool transportSender::run(void *data) {
+	bufferTag tag = pipeExec::getCurrentTag();
+	frameHeader header;
+	struct iovec iov[2];
+	int flags = 0;
+
+	if ( ! waitForCredit() ) {
+		++state_->dropped;
+		return true;
+	}
+
+	header.magic = TRANSPORT_MAGIC;
+	header.type = FRAME_DATA;
+	header.size = state_->payloadSize;
+	header.lane = tag.lane;
+	header.budget = tag.deadline == LLONG_MAX ? INT64_MAX : tag.deadline - SimpleMemoryManager::now();
+
+	// The payload goes to the socket straight from the pool buffer
+	iov[0].iov_base = &header;
+	iov[0].iov_len = sizeof(header);
+	iov[1].iov_base = data;
+	iov[1].iov_len = state_->payloadSize;
+
+	std::lock_guard<std::mutex> lock(state_->sendMutex);
+
+	if ( state_->batch > 1 && state_->unflushed + 1 < state_->batch )
+		flags = MSG_MORE;
+
+	if ( state_->failed || ! sendAll(state_->fd, iov, 2, flags) ) {
+		state_->failed = true;
+		++state_->dropped;
+		return true;
+	}
+
+	++state_->frames;
+	if ( flags == MSG_MORE ) {
+		if ( state_->unflushed++ == 0 )
+			state_->flushWake.notify_one();
+	} else
+		state_->unflushed = 0;
+
+	return true;
+}
+
+// The last instance to end tells the receiver there is nothing else coming
+void transportSender::end() {
+	std::lock_guard<std::mutex> lock(state_->sendMutex);
+	frameHeader header;
+	struct iovec iov;
+
+	if ( --state_->active > 0 || state_->failed )
+		return;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = TRANSPORT_MAGIC;
+	header.type = FRAME_END;
+	iov.iov_base = &header;
+	iov.iov_len = sizeof(header);
+	sendAll(state_->fd, &iov, 1, 0);
+	state_->unflushed = 0;
+}
+
+// Receiver
+
+transportReceiver::transportReceiver(int fd, SimpleMemoryManager *head, size_t payloadSize)
+: fd_(fd), head_(head), payloadSize_(payloadSize), frames_(0), thread_(NULL) {}
+
+transportReceiver::~transportReceiver() {
+
+	stop();
+}
+
+void transportReceiver::start() {
+
+	if ( thread_ == NULL )
+		thread_ = new std::thread(&transportReceiver::receiveThread, this);
+}
+
+void transportReceiver::stop() {
+
+	if ( thread_ == NULL )
+		return;
+
+	shutdown(fd_, SHUT_RDWR);
+	waitForEnd();
+}
+
+void transportReceiver::waitForEnd() {
+
+	if ( thread_ == NULL )
+		return;
+
+	thread_->join();
+	delete thread_;
+	thread_ = NULL;
+}
+
+bool transportReceiver::sendCredits(uint32_t credits) {
+	creditMessage message;
+	struct iovec iov;
+
+	message.magic = TRANSPORT_MAGIC;
+	message.credits = credits;
+	iov.iov_base = &message;
+	iov.iov_len = sizeof(message);
+
+	return sendAll(fd_, &iov, 1, 0);
+}
+
+void transportReceiver::receiveThread() {
+	frameHeader header;
+	bufferTag tag;
+	uint32_t credits = 0;
+	void *buffer;
+
+	for (;;) {
+		// With nothing reserved the sender has no credits left, so block for a
+		// free buffer. Then grab whatever else is free and grant it in one go.
+		if ( reserved_.empty() ) {
+			head_->waitForFree();
+			reserved_.push_back(head_->getFreeBuffer());
+			++credits;
+		}
+		while ( head_->tryWaitForFree() ) {
+			reserved_.push_back(head_->getFreeBuffer());
+			++credits;
+		}
+		if ( credits ) {
+			if ( ! sendCredits(credits) )
+				break;
+			credits = 0;
+		}
+
+		if ( ! readAll(fd_, &header, sizeof(header)) || header.magic != TRANSPORT_MAGIC )
+			break;
+		if ( header.type == FRAME_END )
+			break;
+		if ( header.size != payloadSize_ ) {
+			std::cout << "transportReceiver - ERROR frame of " << header.size << " bytes, expected " << payloadSize_ << std::endl;
+			break;
+		}
+
+		// Read the payload straight into the reserved pool buffer
+		buffer = reserved_.front();
+		if ( ! readAll(fd_, buffer, payloadSize_) )
+			break;
+		reserved_.pop_front();
+
+		tag.lane = header.lane;
+		tag.deadline = header.budget == INT64_MAX ? LLONG_MAX : SimpleMemoryManager::now() + header.budget;
+		head_->putFullBuffer(buffer, tag);
+		++frames_;
+	}
+
+	// Buffers reserved for frames that never came go back to the pool
+	while ( ! reserved_.empty() ) {
+		head_->putFreeBuffer(reserved_.front());
+		reserved_.pop_front();
+	}
+}
@@ -0,0 +1,110 @@
+// pipeTransport.h
+
+#ifndef _pipeTransport_h_
+#define _pipeTransport_h_
+
+#include <stdint.h>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include "pipeExec.h"
+
+// An edge between two pipes running in different processes or hosts. The
+// upstream pipe ends with a transportSender stage, which writes every buffer
+// to the socket as a frame straight from the pool memory. On the other side a
+// transportReceiver loads the frames into the head of the downstream pipe.
+//
+// Flow control mirrors the free/full pools: the receiver reserves free buffers
+// of its head and grants one credit per buffer reserved. The sender only sends
+// a frame when it holds a credit, so a frame always has a buffer waiting for it.
+//
+// Addresses are "tcp:host:port" or "unix:/path/to/socket".
+
+int transportAccept(const char *address);			// Listen and accept one peer, returns the fd or -1
+int transportConnect(const char *address, int timeoutMs = 5000);	// Connect, retrying until timeoutMs
+
+// transportAccept in two steps, so the address is bound before the peer is
+// told about it. A tcp port of 0 picks a free port, returned in port. The
+// accept closes the listener.
+int transportListen(const char *address, int *port = NULL);
+int transportAccept(int listener);
+
+// State shared by all the instances of a transportSender
+typedef struct {
+	   int			fd;
+	   size_t		payloadSize;
+	   int			batch;
+	   std::mutex		sendMutex;
+	   std::mutex		creditMutex;
+	   long			credits;
+	   int			unflushed;	// Frames held back by MSG_MORE
+	   int			active;		// Running instances, the last one sends the end frame
+	   std::atomic<bool>	failed;		// The peer went away, later buffers are dropped
+	   unsigned long long	frames;
+	   std::atomic<unsigned long long>	dropped;
+	   std::condition_variable	flushWake;
+	   bool			flushStop;
+	   std::thread		*flusher;
+} transportState;
+
+// Tail stage of the upstream pipe. With batch > 1, frames are corked with
+// MSG_MORE and pushed every batch frames or after lingerUs without a send.
+// Once the peer goes away the sender keeps taking buffers and drops them, so
+// the upstream pipe drains instead of waiting on a stage that has ended. The
+// dropped buffers are counted by getDropped().
+class transportSender : public PipeBase {
+
+	   public:
+
+			 transportSender(int fd, size_t payloadSize, int batch = 1, unsigned int lingerUs = 200);
+			 ~transportSender();
+
+			 bool init();
+			 bool run(void *data);
+			 void end();
+			 transportSender * clone() const;
+
+			 unsigned long long getFrames() { return state_->frames; }
+			 unsigned long long getDropped() { return state_->dropped; }
+
+	   private:
+
+			 transportSender(const transportSender *parent);
+			 bool waitForCredit();
+			 void flusherThread();
+
+			 transportState *state_;
+			 bool owner_;
+			 unsigned int lingerUs_;
+};
+
+// Feeds the frames read from the socket into the head of the downstream pipe
+class transportReceiver {
+
+	   public:
+
+			 transportReceiver(int fd, SimpleMemoryManager *head, size_t payloadSize);
+			 ~transportReceiver();
+
+			 void start();
+			 void stop();		// Shuts the socket down and waits for the thread
+			 void waitForEnd();	// Waits until the sender ends the stream
+
+			 unsigned long long getFrames() { return frames_; }
+
+	   private:
+
+			 void receiveThread();
+			 bool sendCredits(uint32_t credits);
+
+			 int fd_;
+			 SimpleMemoryManager *head_;
+			 size_t payloadSize_;
+			 std::deque<void*> reserved_;
+			 unsigned long long frames_;
+			 std::thread *thread_;
+};
+
+#endif
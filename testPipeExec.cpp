@@ -1,7 +1,16 @@
 #include "pipeExec.h"
 #include "testPipeExec.h"
+#include "pipeKernels.h"
+#include "pipeChain.h"
+#include "pipeCheckpoint.h"
+#include "pipeCache.h"
+#include <algorithm>
 #include <chrono>
 #include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <climits>
+#include <sys/stat.h>
 
 bool adder::run(void* data) {
 	int* count;
@@ -34,7 +43,773 @@ adder * adder::clone() const { return new adder(); }
 subs * subs::clone() const { return new subs(); }
 printer * printer::clone() const { return new printer(); }
 
+bool stepper::run(void* data) {
 
+	*(int *)data += step_;
+	if ( runs_ ) ++*runs_;
+
+	return true;
+}
+
+bool gatedStepper::run(void* data) {
+	std::unique_lock<std::mutex> lock(gate_->lock);
+
+	++gate_->arrived;
+	gate_->changed.notify_all();
+	while ( ! gate_->open )
+		gate_->changed.wait(lock);
+
+	*(int *)data += step_;
+
+	return true;
+}
+
+bool collector::run(void* data) {
+	std::lock_guard<std::mutex> lock(seen_->lock);
+
+	seen_->values.push_back(*(int *)data);
+	seen_->lanes.push_back(pipeExec::getCurrentTag().lane);
+
+	return true;
+}
+
+bool faultyStage::init() {
+	std::lock_guard<std::mutex> lock(count_->lock);
+
+	if ( count_->inits == 0 )
+		return false;
+	if ( count_->inits > 0 )
+		--count_->inits;
+	++count_->live;
+
+	return true;
+}
+
+bool faultyStage::run(void* data) {
+	int *values = (int *)data;
+
+	++values[1];
+	if ( values[0] % 10 == 0 )
+		throw values[0];
+
+	return values[0] % 5 != 0 || values[1] > 1;
+}
+
+void faultyStage::end() {
+	std::lock_guard<std::mutex> lock(count_->lock);
+
+	if ( --count_->live == 0 )
+		++count_->closed;
+}
+
+bool countedStepper::init() {
+	std::lock_guard<std::mutex> lock(count_->lock);
+
+	++count_->live;
+
+	return true;
+}
+
+bool countedStepper::run(void* data) {
+
+	*(int *)data += step_;
+
+	return true;
+}
+
+void countedStepper::end() {
+	std::lock_guard<std::mutex> lock(count_->lock);
+
+	if ( --count_->live == 0 )
+		++count_->closed;
+}
+
+bool affine::run(void* data) {
+	int *values = (int *)data;
+
+	values[0] = values[from_] * mul_ + add_;
+	++*runs_;
+
+	return true;
+}
+
+stepper * stepper::clone() const { return new stepper(step_, runs_); }
+gatedStepper * gatedStepper::clone() const { return new gatedStepper(step_, gate_); }
+faultyStage * faultyStage::clone() const { return new faultyStage(count_); }
+countedStepper * countedStepper::clone() const { return new countedStepper(step_, count_); }
+affine * affine::clone() const { return new affine(from_, mul_, add_, runs_); }
+collector * collector::clone() const { return new collector(seen_); }
+
+// Run the numeric kernels with every ISA the CPU supports and compare them
+// against the scalar version. Odd sizes exercise the tails, and there is a
+// NaN in the vector body and another in the tail.
+bool testKernels()
+{
+	const size_t count = 1003;
+	float ref[count], vec[count];
+	uint32_t words[count];
+	uint64_t refBins[256], vecBins[256];
+	uint64_t refSum;
+	kernelIsa best;
+	bool passed = true;
+
+	for (size_t i = 0; i < count; ++i) {
+		ref[i] = (float)i - 500.0f;
+		words[i] = 0xFFFFFF00u + i;
+	}
+	ref[7] = ref[1001] = NAN;
+
+	setKernelIsa(ISA_SCALAR);
+	kernelScale(ref, count, 0.5f);
+	kernelOffset(ref, count, 3.0f);
+	kernelClamp(ref, count, -100.0f, 100.0f);
+	refSum = kernelChecksum(words, count);
+	memset(refBins, 0, sizeof(refBins));
+	kernelHistogram((uint8_t *)words, sizeof(words), refBins);
+	passed = isnan(ref[7]) && isnan(ref[1001]);
+
+	best = setKernelIsa(ISA_AVX512);
+	for (int isa = ISA_SCALAR; isa <= best; ++isa) {
+		setKernelIsa((kernelIsa)isa);
+		for (size_t i = 0; i < count; ++i)
+			vec[i] = (float)i - 500.0f;
+		vec[7] = vec[1001] = NAN;
+		kernelScale(vec, count, 0.5f);
+		kernelOffset(vec, count, 3.0f);
+		kernelClamp(vec, count, -100.0f, 100.0f);
+		memset(vecBins, 0, sizeof(vecBins));
+		kernelHistogram((uint8_t *)words, sizeof(words), vecBins);
+
+		bool ok = memcmp(ref, vec, sizeof(ref)) == 0 && kernelChecksum(words, count) == refSum &&
+			memcmp(refBins, vecBins, sizeof(refBins)) == 0;
+		cout << "Kernels " << getKernelIsaName((kernelIsa)isa) << (ok ? " OK" : " FAILED") << endl;
+		passed = passed && ok;
+	}
+	setKernelIsa(best);
+
+	return passed;
+}
+
+// Run the numeric stages in a pipe, several instances each, on a payload that
+// starts after an 8 byte header. The checksum and histogram totals shared by
+// the clones must match the kernels run directly on the same data.
+bool testStages()
+{
+	const size_t count = 301, offset = 8;
+	const int buffers = 64;
+	SimpleMemoryManager *pool = new SimpleMemoryManager(bufferView<float>::extent(count, offset), 8);
+	scaleStage scale(0.5f, count, offset);
+	offsetStage shift(3.0f, count, offset);
+	clampStage clamp(-100.0f, 100.0f, count, offset);
+	checksumStage checksum(count, offset);
+	histogramStage histogram(count * sizeof(float), offset);
+	float ref[count];
+	uint64_t refSum = 0, refBins[256], bins[256];
+	pipeExec *myPipe;
+	bool ok;
+
+	ok = scale.getExtent() <= pool->getBufferSize() && shift.getExtent() <= pool->getBufferSize() &&
+		clamp.getExtent() <= pool->getBufferSize() && checksum.getExtent() <= pool->getBufferSize() &&
+		histogram.getExtent() <= pool->getBufferSize();
+
+	myPipe = new pipeExec(&scale, pool, 2);
+	myPipe->addFunction(&shift, 2);
+	myPipe->addFunction(&clamp, 2);
+	myPipe->addFunction(&checksum, 3);
+	myPipe->addFunction(&histogram, 3);
+	myPipe->runPipe();
+
+	memset(refBins, 0, sizeof(refBins));
+	for (int b = 0; b < buffers; ++b) {
+		char *data;
+
+		for (size_t i = 0; i < count; ++i)
+			ref[i] = (float)(i + b) - 400.0f;
+
+		pool->waitForFree();
+		data = (char *)pool->getFreeBuffer();
+		memset(data, 0xA5, offset);
+		memcpy(data + offset, ref, sizeof(ref));
+		pool->putFullBuffer(data);
+
+		kernelScale(ref, count, 0.5f);
+		kernelOffset(ref, count, 3.0f);
+		kernelClamp(ref, count, -100.0f, 100.0f);
+		refSum += kernelChecksum((uint32_t *)ref, count);
+		kernelHistogram((uint8_t *)ref, sizeof(ref), refBins);
+	}
+	pool->waitForDone();
+	myPipe->killPipe();
+
+	histogram.getHistogram(bins);
+	ok = ok && checksum.getChecksum() == refSum && memcmp(bins, refBins, sizeof(bins)) == 0;
+	cout << "Kernel stages" << (ok ? " OK" : " FAILED") << endl;
+
+	delete myPipe;
+	delete pool;
+
+	return ok;
+}
+
+// Build a framed record out of chains, split and slice it, write it to a
+// pipe with writev and check the bytes and that every segment is returned.
+// An empty append and a pool too small for a segment are refused.
+bool testChains()
+{
+	SimpleMemoryManager *pool = new SimpleMemoryManager(256, 32);
+	char body[1000], header[16], out[2000];
+	int fds[2];
+	bool ok = true;
+
+	for (int i = 0; i < 1000; ++i)
+		body[i] = (char)i;
+	memset(header, 'H', sizeof(header));
+
+	{
+		bufferChain record(pool), copy(pool);
+
+		record.append(body, sizeof(body));
+		record.prepend(header, sizeof(header));
+		ok = ok && record.size() == 1016;
+
+		// Split off the header and put it back at the end
+		bufferChain rest = record.split(sizeof(header));
+		rest.append(record);
+		ok = ok && rest.size() == 1016 && rest.copyOut(out, 1000, 16) == 16 && memcmp(out, header, 16) == 0;
+
+		bufferChain middle = rest.slice(300, 400);
+		ok = ok && middle.copyOut(out, 0, 400) == 400 && memcmp(out, body + 300, 400) == 0;
+
+		copy = rest;
+		pipe(fds);
+		ok = ok && copy.writeTo(fds[1]) == 1016;
+		ok = ok && read(fds[0], out, sizeof(out)) == 1016 && memcmp(out, body, 1000) == 0 && memcmp(out + 1000, header, 16) == 0;
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	// No space is handed out for nothing, or from buffers that cannot hold
+	// the segment header
+	{
+		SimpleMemoryManager *tiny = new SimpleMemoryManager(16, 2);
+		bufferChain chain(pool);
+
+		ok = ok && chain.appendSpace(0) == NULL && chain.getSegmentCount() == 0;
+		ok = ok && ! chain.setPool(tiny) && chain.appendSpace(8) == NULL && tiny->getFreeCount() == 2;
+		delete tiny;
+	}
+
+	ok = ok && pool->getFreeCount() == pool->getBufferCount();
+	cout << "Buffer chains" << (ok ? " OK" : " FAILED") << endl;
+	delete pool;
+
+	return ok;
+}
+
+static long fileSize(const char *path)
+{
+	struct stat info;
+
+	return stat(path, &info) == 0 ? info.st_size : -1;
+}
+
+// Copies the first size bytes of a file
+static void copyFile(const char *from, const char *to, long size)
+{
+	std::vector<char> bytes(size);
+	FILE *in = fopen(from, "rb"), *out = fopen(to, "wb");
+
+	fread(bytes.data(), 1, size, in);
+	fwrite(bytes.data(), 1, size, out);
+	fclose(in);
+	fclose(out);
+}
+
+// Four buffers go past the first stage and wait in the slow one while a
+// snapshot is taken. Once they are done a second snapshot clears them. A copy
+// of the log torn in the middle of the second snapshot must load as the first
+// one, and replaying it into a fresh pipe must only run the later stages.
+// Reopening the torn log must drop the torn tail before appending to it.
+// Both pipes have two priority lanes and the buffers keep their lane.
+bool testCheckpoint()
+{
+	const int buffers = 4, payload = 16 * sizeof(int);
+	char path[64], tornPath[80];
+	std::vector<checkpointRecord> records;
+	std::atomic<int> firstRuns(0);
+	stageGate gate;
+	collection seen;
+	bool ok = true;
+	long before, after;
+
+	snprintf(path, sizeof(path), "/tmp/testPipeExec.%d.ckp", (int)getpid());
+	snprintf(tornPath, sizeof(tornPath), "%s.torn", path);
+	unlink(path);
+	gate.open = false;
+	gate.arrived = 0;
+
+	{
+		SimpleMemoryManager *head = new SimpleMemoryManager(payload, buffers);
+		pipeCheckpoint checkpoint(path, payload, 60000);
+		bufferTag tag;
+		stepper first(1), last(100);
+		gatedStepper slow(10, &gate);
+		pipeExec *myPipe = new pipeExec(&first, head);
+
+		head->setQueueMode(SimpleMemoryManager::MODE_PRIORITY, 2);
+		myPipe->addFunction(&slow, buffers);
+		myPipe->addFunction(&last);
+		myPipe->setCheckpoint(&checkpoint);
+		myPipe->runPipe();
+
+		for (int i = 1; i <= buffers; ++i) {
+			head->waitForFree();
+			int *data = (int *)head->getFreeBuffer();
+			*data = i * 1000;
+			tag.lane = i % 2;
+			tag.deadline = LLONG_MAX;
+			head->putFullBuffer(data, tag);
+		}
+
+		// Every instance of the slow stage holds a buffer the first stage completed
+		{
+			std::unique_lock<std::mutex> lock(gate.lock);
+			while ( gate.arrived < buffers )
+				gate.changed.wait(lock);
+		}
+		ok = ok && checkpoint.snapshot() == buffers;
+		before = fileSize(path);
+
+		gate.lock.lock();
+		gate.open = true;
+		gate.lock.unlock();
+		gate.changed.notify_all();
+		head->waitForDone();
+		ok = ok && checkpoint.snapshot() == buffers;
+		after = fileSize(path);
+
+		myPipe->killPipe();
+		delete myPipe;
+		delete head;
+	}
+
+	copyFile(path, tornPath, before + (after - before) / 2);
+
+	{
+		pipeCheckpoint complete(path, payload);
+		ok = ok && complete.load(records) == 0;
+	}
+
+	{
+		SimpleMemoryManager *head = new SimpleMemoryManager(payload, buffers);
+		pipeCheckpoint torn(tornPath, payload);
+		stepper first(1, &firstRuns), slow(10), last(100);
+		collector collect(&seen);
+		pipeExec *myPipe = new pipeExec(&first, head);
+
+		ok = ok && torn.load(records) == buffers;
+		for (int i = 0; i < records.size(); ++i)
+			ok = ok && records[i].stage == 0 && *(int *)records[i].payload.data() % 1000 == 1 &&
+				records[i].tag.lane == *(int *)records[i].payload.data() / 1000 % 2;
+
+		head->setQueueMode(SimpleMemoryManager::MODE_PRIORITY, 2);
+		myPipe->addFunction(&slow);
+		myPipe->addFunction(&last);
+		myPipe->addFunction(&collect);
+		ok = ok && myPipe->replayCheckpoint(&torn) == buffers;
+		myPipe->runPipe();
+		head->waitForDone();
+		myPipe->killPipe();
+		delete myPipe;
+		delete head;
+	}
+
+	// Opening the torn log cut it back to the first snapshot, so a snapshot
+	// appended now is the one that loads
+	{
+		pipeCheckpoint reopened(tornPath, payload);
+		ok = ok && fileSize(tornPath) == before && reopened.snapshot(true) == 0 && reopened.load(records) == 0;
+	}
+
+	ok = ok && firstRuns == 0 && seen.values.size() == buffers;
+	for (int i = 0; ok && i < buffers; ++i)
+		ok = seen.values[i] % 1000 == 111 && seen.lanes[i] == seen.values[i] / 1000 % 2;
+	std::sort(seen.values.begin(), seen.values.end());
+	for (int i = 0; ok && i < buffers; ++i)
+		ok = seen.values[i] == (i + 1) * 1000 + 111;
+
+	cout << "Checkpoint replay" << (ok ? " OK" : " FAILED") << endl;
+	unlink(path);
+	unlink(tornPath);
+
+	return ok;
+}
+
+// Hands the dead letters back to the head until it gets a NULL
+static void drainDeadLetters(SimpleMemoryManager *deadLetter, SimpleMemoryManager *head)
+{
+	void *data;
+
+	for (;;) {
+		deadLetter->waitForFull();
+		if ( (data = deadLetter->getFullBuffer()) == NULL )
+			break;
+		head->putFreeBuffer(data);
+	}
+}
+
+// Send 50 buffers through a middle stage that always fails 5 of them and
+// fails 5 others once, with 2 retries, under each policy
+static bool runErrorPolicy(pipeExec::errorPolicy policy, pipeExec::errorStats *stats, int *closed, int inits = -1)
+{
+	const int buffers = 50;
+	SimpleMemoryManager *head = new SimpleMemoryManager(2 * sizeof(int), 4);
+	SimpleMemoryManager *deadLetter = NULL;
+	instanceCount count;
+	stepper first(0), last(0);
+	faultyStage faulty(&count);
+	pipeExec *myPipe = new pipeExec(&first, head);
+	std::thread *drainer = NULL;
+	int position;
+
+	count.live = count.closed = 0;
+	count.inits = inits;
+	myPipe->addFunction(&faulty);
+	myPipe->addFunction(&last);
+
+	if ( policy == pipeExec::ERR_DEADLETTER ) {
+		deadLetter = new SimpleMemoryManager(0, head->getBufferCount());
+		drainer = new std::thread(drainDeadLetters, deadLetter, head);
+	}
+
+	position = myPipe->setErrorPolicy(&faulty, policy, 2, deadLetter);
+	myPipe->runPipe();
+
+	for (int i = 1; i <= buffers; ++i) {
+		head->waitForFree();
+		int *data = (int *)head->getFreeBuffer();
+		data[0] = i;
+		data[1] = 0;
+		head->putFullBuffer(data);
+	}
+	head->waitForDone();
+	if ( drainer ) {
+		deadLetter->putFullBuffer(NULL);
+		drainer->join();
+		delete drainer;
+	}
+
+	*stats = myPipe->getErrorStats(position);
+	myPipe->killPipe();
+	*closed = count.closed;
+
+	delete myPipe;
+	delete deadLetter;
+	delete head;
+
+	return position == 1;
+}
+
+bool testErrorPolicies()
+{
+	pipeExec::errorStats stats;
+	int closed;
+	bool ok;
+
+	ok = runErrorPolicy(pipeExec::ERR_RETRY, &stats, &closed) && stats.failures == 20 && stats.retried == 15 &&
+		stats.restarts == 0 && stats.deadLettered == 0 && stats.dropped == 5;
+	cout << "Error policy retry" << (ok ? " OK" : " FAILED") << endl;
+
+	// The stage only ends once, when the pipe is killed
+	bool restart = runErrorPolicy(pipeExec::ERR_RESTART, &stats, &closed) && stats.failures == 20 && stats.retried == 15 &&
+		stats.restarts == 20 && stats.failedRestarts == 0 && stats.deadLettered == 0 && stats.dropped == 5 && closed == 1;
+	cout << "Error policy restart" << (restart ? " OK" : " FAILED") << endl;
+
+	// No clone initializes, so the failing instance keeps running
+	bool kept = runErrorPolicy(pipeExec::ERR_RESTART, &stats, &closed, 1) && stats.failures == 20 && stats.retried == 15 &&
+		stats.restarts == 0 && stats.failedRestarts == 20 && stats.dropped == 5 && closed == 1;
+	cout << "Error policy failed restart" << (kept ? " OK" : " FAILED") << endl;
+
+	bool dead = runErrorPolicy(pipeExec::ERR_DEADLETTER, &stats, &closed) && stats.failures == 10 && stats.retried == 0 &&
+		stats.restarts == 0 && stats.deadLettered == 10 && stats.dropped == 0;
+	cout << "Error policy dead letter" << (dead ? " OK" : " FAILED") << endl;
+
+	return ok && restart && kept && dead;
+}
+
+// Queue a buffer per value before the pipe runs, so the first stage sees them
+// all and serves them in lane or deadline order
+static void runLanes(SimpleMemoryManager *head, collection *seen, const bufferTag *tags, int buffers)
+{
+	stepper first(0), middle(0);
+	collector collect(seen);
+	pipeExec *myPipe = new pipeExec(&first, head);
+
+	myPipe->addFunction(&middle);
+	myPipe->addFunction(&collect);
+
+	for (int i = 0; i < buffers; ++i) {
+		head->waitForFree();
+		int *data = (int *)head->getFreeBuffer();
+		*data = i;
+		head->putFullBuffer(data, tags[i]);
+	}
+
+	myPipe->runPipe();
+	head->waitForDone();
+
+	// Every stage saw every lane
+	for (int stage = 0; stage < 3; ++stage)
+		for (int lane = 0; lane < head->getLanes(); ++lane) {
+			laneStats stats = myPipe->getLaneStats(stage, lane);
+			seen->values.push_back(stats.dequeued);
+			seen->values.push_back(stats.missed);
+		}
+
+	myPipe->killPipe();
+	delete myPipe;
+}
+
+// Priority order with three lanes, then earliest deadline first with a few
+// deadlines already missed. The lane statistics of every stage are appended
+// to the values seen by the tail.
+bool testLanes()
+{
+	const int buffers = 12;
+	SimpleMemoryManager *head = new SimpleMemoryManager(sizeof(int), buffers);
+	bufferTag tags[buffers];
+	collection priority, deadline;
+	std::vector<int> expected;
+	long long base = SimpleMemoryManager::now();
+	bool ok;
+
+	head->setQueueMode(SimpleMemoryManager::MODE_PRIORITY, 3);
+	for (int i = 0; i < buffers; ++i) {
+		tags[i].lane = i % 3;
+		tags[i].deadline = LLONG_MAX;
+	}
+	runLanes(head, &priority, tags, buffers);
+
+	for (int lane = 0; lane < 3; ++lane)
+		for (int i = lane; i < buffers; i += 3)
+			expected.push_back(i);
+	for (int stage = 0; stage < 3; ++stage)
+		for (int lane = 0; lane < 3; ++lane) {
+			expected.push_back(buffers / 3);
+			expected.push_back(0);
+		}
+	ok = priority.values == expected;
+	cout << "Priority lanes" << (ok ? " OK" : " FAILED") << endl;
+
+	// Every fourth buffer is already late, the rest have deadlines in the
+	// reverse order they are queued in
+	head->setQueueMode(SimpleMemoryManager::MODE_DEADLINE, 2);
+	expected.clear();
+	for (int i = 0; i < buffers; ++i) {
+		tags[i].lane = i % 2;
+		if ( i % 4 == 0 ) {
+			tags[i].deadline = base - 1000000LL * (buffers - i);
+			expected.push_back(i);
+		} else
+			tags[i].deadline = base + 10000000000LL + 1000000LL * (buffers - i);
+	}
+	for (int i = buffers - 1; i >= 0; --i)
+		if ( i % 4 != 0 )
+			expected.push_back(i);
+	for (int stage = 0; stage < 3; ++stage) {
+		expected.push_back(buffers / 2);
+		expected.push_back(buffers / 4);
+		expected.push_back(buffers / 2);
+		expected.push_back(0);
+	}
+	runLanes(head, &deadline, tags, buffers);
+
+	bool edf = deadline.values == expected;
+	cout << "Deadline lanes" << (edf ? " OK" : " FAILED") << endl;
+
+	delete head;
+
+	return ok && edf;
+}
+
+// Feed buffers numbered from first, each starting at its number times 1000
+static void feed(SimpleMemoryManager *head, int first, int count)
+{
+	for (int i = first; i < first + count; ++i) {
+		head->waitForFree();
+		int *data = (int *)head->getFreeBuffer();
+		*data = i * 1000;
+		head->putFullBuffer(data);
+	}
+}
+
+// Delete a middle stage and then the first one while buffers are flowing,
+// then kill the pipe twice and destroy it. Buffers fed after a deletion must
+// skip the deleted stage and no buffer may be lost. The stage moved onto the
+// head must keep its instances, so it only ends once. A pipe whose only stage
+// is deleted keeps passing buffers. Deleting a stage with a checkpoint set
+// must move the buffers in flight after it down one stage.
+bool testDeleteAndKill()
+{
+	SimpleMemoryManager *head = new SimpleMemoryManager(sizeof(int), 6);
+	instanceCount count;
+	stepper first(1), middle(10), only(1);
+	countedStepper last(100, &count);
+	collection seen;
+	collector collect(&seen);
+	pipeExec *myPipe = new pipeExec(&first, head);
+	bool ok = true;
+
+	count.live = count.closed = 0;
+	count.inits = -1;
+	myPipe->addFunction(&middle, 2);
+	myPipe->addFunction(&last, 2);
+	myPipe->addFunction(&collect);
+	myPipe->runPipe();
+
+	feed(head, 1, 10);
+	myPipe->deleteFunction(&middle);
+	feed(head, 11, 10);
+	myPipe->deleteFunction(&first);
+	feed(head, 21, 10);
+	head->waitForDone();
+
+	ok = count.closed == 0 && count.live == 2;
+	ok = ok && myPipe->killPipe() == 3 && myPipe->killPipe() == 0 && count.closed == 1;
+	delete myPipe;
+
+	ok = ok && seen.values.size() == 30;
+	for (int i = 0; ok && i < seen.values.size(); ++i) {
+		int number = seen.values[i] / 1000, steps = seen.values[i] % 1000;
+
+		if ( number <= 10 )
+			ok = steps == 111 || steps == 101;
+		else
+			ok = steps == ( number <= 20 ? 101 : 100 );
+	}
+
+	myPipe = new pipeExec(&only, head);
+	myPipe->runPipe();
+	myPipe->deleteFunction(&only);
+	feed(head, 1, 10);
+	head->waitForDone();
+	ok = ok && myPipe->killPipe() == 1 && myPipe->killPipe() == 0;
+	delete myPipe;
+
+	// Every buffer waits in the gated stage, completed by the second stage,
+	// which is the first one once the first is deleted
+	{
+		const int buffers = 4;
+		SimpleMemoryManager *held = new SimpleMemoryManager(sizeof(int), buffers);
+		std::vector<checkpointRecord> records;
+		char path[64];
+		stageGate gate;
+
+		snprintf(path, sizeof(path), "/tmp/testPipeExec.%d.del.ckp", (int)getpid());
+		unlink(path);
+		gate.open = false;
+		gate.arrived = 0;
+
+		pipeCheckpoint checkpoint(path, sizeof(int), 60000);
+		gatedStepper slow(100, &gate);
+		myPipe = new pipeExec(&first, held);
+		myPipe->addFunction(&middle);
+		myPipe->addFunction(&slow, buffers);
+		myPipe->setCheckpoint(&checkpoint);
+		myPipe->runPipe();
+
+		feed(held, 1, buffers);
+		{
+			std::unique_lock<std::mutex> lock(gate.lock);
+			while ( gate.arrived < buffers )
+				gate.changed.wait(lock);
+		}
+		myPipe->deleteFunction(&first);
+
+		ok = ok && checkpoint.snapshot() == buffers && checkpoint.load(records) == buffers;
+		for (int i = 0; ok && i < records.size(); ++i)
+			ok = records[i].stage == 0 && *(int *)records[i].payload.data() % 1000 == 11;
+
+		gate.lock.lock();
+		gate.open = true;
+		gate.lock.unlock();
+		gate.changed.notify_all();
+		held->waitForDone();
+		myPipe->killPipe();
+		delete myPipe;
+		delete held;
+		unlink(path);
+	}
+
+	cout << "Delete and kill" << (ok ? " OK" : " FAILED") << endl;
+	delete head;
+
+	return ok;
+}
+
+// Run buffers holding an output and then an input through a cached stage.
+// The inputs cycle through 5 values and the tail keeps every output.
+static void runCache(cacheStage *cache, collection *seen, int buffers)
+{
+	SimpleMemoryManager *head = new SimpleMemoryManager(2 * sizeof(int), 8);
+	collector collect(seen);
+	pipeExec *myPipe = new pipeExec(cache, head);
+
+	myPipe->addFunction(&collect);
+	myPipe->runPipe();
+
+	for (int i = 0; i < buffers; ++i) {
+		head->waitForFree();
+		int *data = (int *)head->getFreeBuffer();
+		data[0] = -1;
+		data[1] = i % 5;
+		head->putFullBuffer(data);
+	}
+	head->waitForDone();
+
+	myPipe->killPipe();
+	delete myPipe;
+	delete head;
+}
+
+// A stage with room for all the inputs only runs on the first of each. A span
+// of two stages with room for 3 of the 5 inputs, seen in a cycle, has every
+// entry evicted before it is used again. The outputs must be right either way.
+bool testCache()
+{
+	const int buffers = 100;
+	std::atomic<int> singleRuns(0), spanRuns(0);
+	affine single(1, 3, 1, &singleRuns), twice(1, 2, 0, &spanRuns), plusFive(0, 1, 5, &spanRuns);
+	std::vector<PipeBase*> span;
+	collection singleSeen, spanSeen;
+	bool ok, evicted;
+
+	cacheStage singleCache(&single, sizeof(int), sizeof(int), 8, sizeof(int), 0, 1);
+	runCache(&singleCache, &singleSeen, buffers);
+
+	ok = singleCache.getHits() == 95 && singleCache.getMisses() == 5 && singleCache.getEvictions() == 0 &&
+		singleRuns == 5 && singleSeen.values.size() == buffers;
+	for (int i = 0; ok && i < buffers; ++i)
+		ok = singleSeen.values[i] == 3 * (i % 5) + 1;
+	cout << "Cache hits" << (ok ? " OK" : " FAILED") << endl;
+
+	span.push_back(&twice);
+	span.push_back(&plusFive);
+	cacheStage spanCache(span, sizeof(int), sizeof(int), 3, sizeof(int), 0, 1);
+	runCache(&spanCache, &spanSeen, buffers);
+
+	evicted = spanCache.getHits() == 0 && spanCache.getMisses() == buffers && spanCache.getEvictions() == buffers - 3 &&
+		spanRuns == 2 * buffers && spanSeen.values.size() == buffers;
+	for (int i = 0; evicted && i < buffers; ++i)
+		evicted = spanSeen.values[i] == 2 * (i % 5) + 5;
+
+	// More shards than entries must not add entries
+	pipeCache small(3, sizeof(int), sizeof(int)), large(20, sizeof(int), sizeof(int));
+	evicted = evicted && small.getCapacity() == 3 && large.getCapacity() == 20;
+	cout << "Cache evictions" << (evicted ? " OK" : " FAILED") << endl;
+
+	return ok && evicted;
+}
 
 int  main(int argc, char** argv)
 {
@@ -45,20 +820,28 @@ int  main(int argc, char** argv)
 	SimpleMemoryManager  *head;
 	pipeExec *myPipe;
 	int bufferSize = 10;
+	int failed = 0;
 
+	failed += ! testKernels();
+	failed += ! testStages();
+	failed += ! testCheckpoint();
+	failed += ! testErrorPolicies();
+	failed += ! testLanes();
+	failed += ! testDeleteAndKill();
+	failed += ! testCache();
+	failed += ! testChains();
 
 	//head = new SimpleMemoryManager(sizeof(int), 10);
 	head = new SimpleMemoryManager(0, bufferSize);
 
 	// Put the buffers in the free queue
-	int *item;
+	void **items = (void **)malloc(bufferSize * sizeof(void *));
 	for (int i = 0; i < bufferSize; ++i)
 	{
-		item = (int *)malloc(sizeof(int));
-		*item = 0;
-		head->loadMemoryManager(item);
-
+		items[i] = malloc(sizeof(int));
+		*(int *)items[i] = 0;
 	}
+	head->loadMemoryManager(items, bufferSize, sizeof(int));
 
 	cout << "CREATING PIPE 1" << endl;
 	myPipe = new pipeExec(&addOne, head);
@@ -126,5 +909,5 @@ int  main(int argc, char** argv)
 	//	sleep(60);
 
 
-	return 0;	
+	return failed;	
 }
@@ -12,3 +12,96 @@ class printer : public PipeBase {
 	bool run(void* data);
 	printer * clone() const;
 };
+
+// Adds step to the first int of the buffer, counting the runs in runs
+class stepper : public PipeBase {
+	public:
+	stepper(int step, std::atomic<int> *runs = NULL) : step_(step), runs_(runs) {}
+	bool run(void* data);
+	stepper * clone() const;
+	private:
+	int step_;
+	std::atomic<int> *runs_;
+};
+
+// Shared by the instances of a gatedStepper
+typedef struct {
+	std::mutex lock;
+	std::condition_variable changed;
+	bool open;
+	int arrived;
+} stageGate;
+
+// A stepper whose instances hold their buffer until the gate is open
+class gatedStepper : public PipeBase {
+	public:
+	gatedStepper(int step, stageGate *gate) : step_(step), gate_(gate) {}
+	bool run(void* data);
+	gatedStepper * clone() const;
+	private:
+	int step_;
+	stageGate *gate_;
+};
+
+// Shared by the instances of a collector
+typedef struct {
+	std::mutex lock;
+	std::vector<int> values;
+	std::vector<int> lanes;
+} collection;
+
+// Keeps the first int and the lane of every buffer, in the order they come
+class collector : public PipeBase {
+	public:
+	collector(collection *seen) : seen_(seen) {}
+	bool run(void* data);
+	collector * clone() const;
+	private:
+	collection *seen_;
+};
+
+// Shared by the instances of a faultyStage
+typedef struct {
+	std::mutex lock;
+	int live;	// Instances between init() and end()
+	int closed;	// Times live dropped to zero
+	int inits;	// init() calls that succeed before the rest fail, -1 for all
+} instanceCount;
+
+// Throws on multiples of 10 and fails other multiples of 5 on their first run.
+// The second int of the buffer counts the runs.
+class faultyStage : public PipeBase {
+	public:
+	faultyStage(instanceCount *count) : count_(count) {}
+	bool init();
+	bool run(void* data);
+	void end();
+	faultyStage * clone() const;
+	private:
+	instanceCount *count_;
+};
+
+// A stepper counting its instances in count
+class countedStepper : public PipeBase {
+	public:
+	countedStepper(int step, instanceCount *count) : step_(step), count_(count) {}
+	bool init();
+	bool run(void* data);
+	void end();
+	countedStepper * clone() const;
+	private:
+	int step_;
+	instanceCount *count_;
+};
+
+// Sets the first int of the buffer to the int at from times mul plus add,
+// counting the runs in runs
+class affine : public PipeBase {
+	public:
+	affine(int from, int mul, int add, std::atomic<int> *runs) : from_(from), mul_(mul), add_(add), runs_(runs) {}
+	bool run(void* data);
+	affine * clone() const;
+	private:
+	int from_, mul_, add_;
+	std::atomic<int> *runs_;
+};
@@ -0,0 +1,169 @@
+#include "pipeExec.h"
+#include "pipeTransport.h"
+#include <unistd.h>
+#include <string.h>
+#include <sys/wait.h>
+
+// Two processes joined by a transport edge. The parent fills every record
+// with its sequence number and sends it; the child adds one to every value
+// and checks all the records arrive.
+
+#define RECORD_INTS	256
+#define RECORDS		2000
+
+class stamp : public PipeBase {
+	public:
+	stamp() : next_(0) {}
+	bool run(void* data) {
+		int *record = (int *)data;
+		int seq = next_++;
+		for (int i = 0; i < RECORD_INTS; ++i)
+			record[i] = seq;
+		return true;
+	}
+	stamp * clone() const { return new stamp(); }
+	private:
+	int next_;
+};
+
+class check : public PipeBase {
+	public:
+	check() : count_(0), errors_(0), sum_(0) {}
+	bool run(void* data) {
+		int *record = (int *)data;
+		for (int i = 1; i < RECORD_INTS; ++i)
+			if ( record[i] != record[0] ) ++errors_;
+		sum_ += record[0];
+		++count_;
+		return true;
+	}
+	check * clone() const { return new check(); }
+	int count_, errors_;
+	long long sum_;
+};
+
+static SimpleMemoryManager *makeHead(int bufferCount)
+{
+	SimpleMemoryManager *head = new SimpleMemoryManager(0, bufferCount);
+
+	for (int i = 0; i < bufferCount; ++i)
+		head->loadMemoryManager(malloc(RECORD_INTS * sizeof(int)));
+
+	return head;
+}
+
+// Downstream process, accepting on the listener bound by the parent
+static int receiveRecords(int listener)
+{
+	SimpleMemoryManager *head = makeHead(8);
+	check checker;
+	pipeExec *myPipe;
+	int fd;
+
+	if ( (fd = transportAccept(listener)) == -1 )
+		return 2;
+
+	myPipe = new pipeExec(&checker, head);
+	myPipe->runPipe();
+
+	transportReceiver receiver(fd, head, RECORD_INTS * sizeof(int));
+	receiver.start();
+	receiver.waitForEnd();
+	head->waitForDone();
+	myPipe->killPipe();
+	close(fd);
+
+	long long expected = (long long)RECORDS * (RECORDS - 1) / 2;
+	cout << "  received " << checker.count_ << " records, " << checker.errors_ << " errors" << endl;
+
+	return ( checker.count_ == RECORDS && checker.errors_ == 0 && checker.sum_ == expected ) ? 0 : 1;
+}
+
+// Downstream process that goes away without granting a credit
+static int hangUp(int listener)
+{
+	int fd;
+
+	if ( (fd = transportAccept(listener)) == -1 )
+		return 2;
+	close(fd);
+
+	return 0;
+}
+
+// Upstream process. The address is bound before the fork, so a tcp port of 0
+// gets a free port the parent can connect to. If the peer hangs up, every
+// record must be dropped and the pipe must still drain.
+static bool sendRecords(const char *spec, int batch, bool peerHangsUp = false)
+{
+	SimpleMemoryManager *head = makeHead(8);
+	stamp stamper;
+	pipeExec *myPipe;
+	char address[64];
+	int listener, port, fd, status;
+	pid_t child;
+
+	if ( (listener = transportListen(spec, &port)) == -1 )
+		return false;
+	if ( port )
+		snprintf(address, sizeof(address), "tcp:127.0.0.1:%d", port);
+	else
+		snprintf(address, sizeof(address), "%s", spec);
+
+	if ( (child = fork()) == 0 )
+		_exit(peerHangsUp ? hangUp(listener) : receiveRecords(listener));
+	close(listener);
+
+	if ( (fd = transportConnect(address)) == -1 )
+		return false;
+
+	transportSender sender(fd, RECORD_INTS * sizeof(int), batch);
+	myPipe = new pipeExec(&stamper, head);
+	myPipe->addFunction(&sender);
+	myPipe->runPipe();
+
+	for (int i = 0; i < RECORDS; ++i) {
+		head->waitForFree();
+		head->putFullBuffer(head->getFreeBuffer());
+	}
+	head->waitForDone();
+	myPipe->killPipe();
+
+	waitpid(child, &status, 0);
+	close(fd);
+
+	if ( ! WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+		return false;
+	if ( peerHangsUp )
+		return sender.getFrames() == 0 && sender.getDropped() == RECORDS;
+
+	return sender.getFrames() == RECORDS && sender.getDropped() == 0;
+}
+
+int main(int argc, char** argv)
+{
+	char unixPath[64];
+	int failed = 0;
+	bool ok;
+
+	snprintf(unixPath, sizeof(unixPath), "unix:/tmp/testPipeTransport.%d", (int)getpid());
+
+	ok = sendRecords(unixPath, 1);
+	cout << "Unix socket edge " << (ok ? "OK" : "FAILED") << endl;
+	failed += ! ok;
+	unlink(unixPath + 5);
+
+	ok = sendRecords("tcp:127.0.0.1:0", 1);
+	cout << "TCP edge " << (ok ? "OK" : "FAILED") << endl;
+	failed += ! ok;
+
+	ok = sendRecords("tcp:127.0.0.1:0", 16);
+	cout << "TCP edge, batches of 16 " << (ok ? "OK" : "FAILED") << endl;
+	failed += ! ok;
+
+	ok = sendRecords("tcp:127.0.0.1:0", 1, true);
+	cout << "TCP edge, peer hangs up " << (ok ? "OK" : "FAILED") << endl;
+	failed += ! ok;
+
+	return failed;
+}